@@ -1,377 +1,2134 @@
 #include "SX1278.h"
-#include "stdlib.h"
+#include "SX1278Hal.h"
 #include "string.h"
 #include "stdio.h"
-#include "math.h"
 #include "esp_system.h"
-#include "driver/spi.h"
-#include "driver/gpio.h"
 #include "esp_log.h"
 
 #define SLEEP_MODE_DEFAULT          0b10000000
 #define STANDBY_MODE_DEFAULT        0b10000001
 #define LORA_MODE                   0b10000000
+#define FSK_SLEEP_MODE              0b00000000
 #define LORA_TX_MODE                0b10000011
 #define LORA_RX_CONTINUOUS_MODE     0b10000101
 #define LORA_RX_SINGLE_MODE         0b10000110
 
 #define BASE_FIFO_ADDR              0b00000000
+#define TX_BASE_FIFO_ADDR           0b10000000
 #define RX_TIMEOUT_MASK             0b10000000
 #define RX_DONE_MASK                0b01000000
 #define PAYLOAD_CRC_ERROR_MASK      0b00100000
 #define VALID_HEADER_MASK           0b00010000
 #define TX_DONE_MASK                0b00001000
+#define FHSS_CHANGE_CHANNEL_MASK    0b00000010
+#define HOP_CHANNEL_MASK            0b00111111
 #define CRC_ON_PAYLOAD_MASK         0b01000000
 #define RX_PAYLOAD_CRC_ON_MASK      0b00000100
+#define LOW_DATA_RATE_OPTIMIZE_MASK 0b00001000
+
+#define CAD_DONE_MASK               0b00000100
+#define CAD_DETECTED_MASK           0b00000001
+
+#define DIO0_RX_DONE                0b00000000
+#define DIO0_TX_DONE                0b01000000
+#define DIO0_CAD_DONE               0b10000000
+#define DIO1_CAD_DETECTED           0b00100000
+#define DIO1_FHSS_CHANGE_CHANNEL    0b00010000
+#define DIO3_VALID_HEADER           0b00000001
+
+#define DIO_IRQ_FALLBACK_MS         1000
+#define LBT_MAX_EXPONENT            5
+#define SNIFF_CAD_SYMBOLS           2
+#define SNIFF_LOCK_SYMBOLS          4
+#define SNIFF_RX_TIMEOUT_SYMBOLS    8
+#define STREAM_POLL_SYMBOLS         4
+
+#define MEMORY_BARRIER()            __sync_synchronize()
+
+#define WORKER_STACK_SIZE           2048
+#define WORKER_PRIORITY             5
+#define COMMAND_QUEUE_LENGTH        8
+
+#define CHIP_VERSION                0x12
+#define RESET_PULSE_US              100
+#define READY_POLL_US               100
+#define READY_TIMEOUT_US            20000
+
+#define LATENCY_BUCKET_SHIFT        5
+
+// Frf = Hz * 2^19 / 32 MHz, reduced to Hz * 256 / 15625
+#define FRF_HZ_DIVISOR              15625
+#define FRF_HZ_MULTIPLIER           256
+#define SCAN_SAMPLES                4
 
 #define LNA_DEFAULT                 0b00100000
 #define HEADER_MODE_MASK            0b00000001
 #define OPERATION_MODE_MASK         0b00000111
 
-static TaskHandle_t tx_done_handle = NULL; 
-static TaskHandle_t rx_done_handle = NULL;
+typedef enum CommandType_enum
+{
+    CommandIrq = 0,
+    CommandTxQueued,
+    CommandRx,
+    CommandCad,
+    CommandSniff,
+    CommandScan,
+    CommandSwitchMode,
+    CommandCall,
+    CommandStop
+} CommandType;
+
+typedef void (*WorkerCall)(SX1278* dev, void* arg);
+
+typedef struct Command_struct
+{
+    CommandType type;
+    WorkerCall call;
+    OperationMode mode;
+    HeaderMode header_mode;
+    uint8_t* buffer;
+    void* job;
+    uint32_t timestamp;
+} Command;
+
+// Lives on the stack of the scanning task, which waits for sync_done
+typedef struct ScanJob_struct
+{
+    const SX1278ChannelPlan* plan;
+    int16_t* rssi;
+    uint32_t dwell_us;
+    uint8_t quietest;
+    uint8_t started;
+    OperationMode previous;
+    uint8_t channel;
+    uint8_t sample;
+    int32_t sum;
+    uint32_t sample_us;
+} ScanJob;
+
+typedef struct ConfigJob_struct
+{
+    const SX1278Settings* settings;
+    uint32_t bytes;
+} ConfigJob;
+
+typedef struct ImplicitJob_struct
+{
+    uint8_t payload_len;
+    uint8_t crc_on;
+} ImplicitJob;
+
+typedef struct HopTableJob_struct
+{
+    const uint32_t* frf;
+    uint8_t count;
+    uint8_t period;
+} HopTableJob;
+
+typedef struct TxRequest_struct
+{
+    const uint8_t* data;
+    uint8_t size;
+    SX1278Op* op;
+} TxRequest;
+
+typedef TxRequest ReplyJob;
+
+static const char* TAG = "SX1278";
+
+static SX1278 devices[SX1278_MAX_DEVICES];
+static uint8_t devices_used[SX1278_MAX_DEVICES] = {0};
+
+
+#ifdef CONFIG_SX1278_TRACE
+static void trace(SX1278* dev, TraceEvent event, uint8_t arg)
+{
+    TraceRecord* record = &dev->trace[dev->trace_head % CONFIG_SX1278_TRACE_LENGTH];
+    record->timestamp = SX1278_hal_time_us();
+    record->event = event;
+    record->mode = dev->mode;
+    record->arg = arg;
+    dev->trace_head++;
+}
+#define TRACE(dev, event, arg)      trace(dev, event, arg)
+#else
+#define TRACE(dev, event, arg)      do { } while (0)
+#endif
+
+static void set_mode(SX1278* dev, OperationMode mode)
+{
+    uint32_t now = SX1278_hal_time_us();
+    dev->stats.mode_dwell_us[dev->mode] += now - dev->mode_since;
+    dev->mode_since = now;
+    dev->mode = mode;
+}
+
+static void finish_sync(SX1278* dev)
+{
+    SX1278_hal_semaphore_give(dev->sync_done);
+}
+
+static void run_sync(SX1278* dev, Command* cmd)
+{
+    // One synchronous command at a time, so sync_done can only be for this one, not a stray task notification
+    SX1278_hal_semaphore_take(dev->sync_lock, SX1278_WAIT_FOREVER);
+    SX1278_hal_queue_send(dev->cmd_queue, cmd, SX1278_WAIT_FOREVER);
+    SX1278_hal_semaphore_take(dev->sync_done, SX1278_WAIT_FOREVER);
+    SX1278_hal_semaphore_give(dev->sync_lock);
+}
+
+// State the worker also uses is only changed on the worker, a call from its own callbacks runs in place
+static void call_on_worker(SX1278* dev, WorkerCall call, void* arg)
+{
+    if (SX1278_hal_task_self() == dev->worker_task)
+    {
+        call(dev, arg);
+        return;
+    }
+    Command cmd = { .type = CommandCall, .call = call, .job = arg };
+    run_sync(dev, &cmd);
+}
+
+static void record_latency(SX1278* dev, uint32_t latency)
+{
+    uint8_t bucket = 0;
+    for (uint32_t rest = latency >> LATENCY_BUCKET_SHIFT; rest > 0 && bucket < SX1278_LATENCY_BUCKETS - 1; rest >>= 1)
+    {
+        bucket++;
+    }
+    dev->stats.irq_latency[bucket]++;
+    if (latency > dev->stats.irq_latency_max_us)
+    {
+        dev->stats.irq_latency_max_us = latency;
+    }
+}
+
+static uint8_t is_shadowed(uint8_t addr)
+{
+    if (addr >= SX1278_SHADOW_SIZE)
+    {
+        return 0;
+    }
+    // Registers the chip updates on its own always go to the hardware
+    switch (addr)
+    {
+    case REG_FIFO:
+    case REG_FIFO_ADDR_PTR:
+    case REG_FIFO_RX_CURRENT_ADDR:
+    case REG_IRQ_FLAGS:
+    case REG_RX_NB_BYTES:
+    case REG_RX_HEADER_CNT_VALUE_MSB:
+    case REG_RX_HEADER_CNT_VALUE_LSB:
+    case REG_RX_PACKET_CNT_VALUE_LSB:
+    case REG_RX_PACKET_CNT_VALUE_MSB:
+    case REG_MODEM_STAT:
+    case REG_PKT_SNR_VALUE:
+    case REG_PKT_RSSI_VALUE:
+    case REG_RSSI_VALUE:
+    case REG_HOP_CHANNEL:
+    case REG_FIFO_RX_BYTE_ADDR:
+    case REG_FEI_MSB:
+    case REG_FEI_MID:
+    case REG_FEI_LSB:
+    case REG_RSSI_WIDEBAND:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+static void shadow_store(SX1278* dev, uint8_t addr, uint8_t data)
+{
+    if (is_shadowed(addr))
+    {
+        dev->shadow[addr] = data;
+        dev->shadow_valid[addr >> 3] |= 1 << (addr & 7);
+    }
+}
+
+static uint8_t shadow_hit(SX1278* dev, uint8_t addr)
+{
+    return is_shadowed(addr) && (dev->shadow_valid[addr >> 3] & (1 << (addr & 7))) != 0;
+}
+
+static uint8_t spi_read(SX1278* dev, uint8_t addr)
+{
+    uint8_t data;
+    uint8_t cmd = ((uint8_t) 0 << 7) | addr;
+
+    SX1278_hal_spi_transfer(dev->config.spi_host, dev->config.cs_pin, cmd, NULL, &data, 1);
+    dev->spi_stats.transactions++;
+    dev->spi_stats.bytes += 2;
+    return data;
+}
+
+uint8_t read_single_access(SX1278* dev, uint8_t addr)
+{
+    if (shadow_hit(dev, addr))
+    {
+#ifdef CONFIG_SX1278_SHADOW_VERIFY
+        uint8_t data = spi_read(dev, addr);
+        if (data != dev->shadow[addr])
+        {
+            ESP_LOGW(TAG, "Shadow mismatch reg %02x: %02x, chip %02x", addr, dev->shadow[addr], data);
+            dev->shadow_mismatches++;
+        }
+#endif
+        return dev->shadow[addr];
+    }
+
+    uint8_t data = spi_read(dev, addr);
+    shadow_store(dev, addr, data);
+    return data;
+}
+
+void write_single_access(SX1278* dev, uint8_t addr, uint8_t data)
+{
+    uint8_t cmd = ((uint8_t) 1 << 7) | addr;
+
+    SX1278_hal_spi_transfer(dev->config.spi_host, dev->config.cs_pin, cmd, &data, NULL, 1);
+    dev->spi_stats.transactions++;
+    dev->spi_stats.bytes += 2;
+    shadow_store(dev, addr, data);
+}
+
+static void write_changed(SX1278* dev, uint8_t addr, uint8_t data)
+{
+    if (read_single_access(dev, addr) != data)
+    {
+        write_single_access(dev, addr, data);
+    }
+}
+
+void read_burst_access(SX1278* dev, uint8_t addr, uint8_t* data, uint8_t len)
+{
+    while (len > 0)
+    {
+        uint8_t chunk = len > SX1278_HAL_SPI_MAX_CHUNK ? SX1278_HAL_SPI_MAX_CHUNK : len;
+        uint8_t cmd = ((uint8_t) 0 << 7) | addr;
+
+        SX1278_hal_spi_transfer(dev->config.spi_host, dev->config.cs_pin, cmd, NULL, data, chunk);
+        dev->spi_stats.transactions++;
+        dev->spi_stats.bytes += chunk + 1;
+
+        // The FIFO pointer keeps advancing across transactions, registers do not
+        if (addr != REG_FIFO)
+        {
+            for (uint8_t i = 0; i < chunk; i++)
+            {
+                shadow_store(dev, addr + i, data[i]);
+            }
+            addr += chunk;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void write_burst_access(SX1278* dev, uint8_t addr, const uint8_t* data, uint8_t len)
+{
+    while (len > 0)
+    {
+        uint8_t chunk = len > SX1278_HAL_SPI_MAX_CHUNK ? SX1278_HAL_SPI_MAX_CHUNK : len;
+        uint8_t cmd = ((uint8_t) 1 << 7) | addr;
+
+        SX1278_hal_spi_transfer(dev->config.spi_host, dev->config.cs_pin, cmd, data, NULL, chunk);
+        dev->spi_stats.transactions++;
+        dev->spi_stats.bytes += chunk + 1;
+
+        if (addr != REG_FIFO)
+        {
+            for (uint8_t i = 0; i < chunk; i++)
+            {
+                shadow_store(dev, addr + i, data[i]);
+            }
+            addr += chunk;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+uint32_t SX1278_verify_shadow(SX1278* dev)
+{
+    uint32_t mismatches = 0;
+    for (uint8_t addr = 0; addr < SX1278_SHADOW_SIZE; addr++)
+    {
+        if (!shadow_hit(dev, addr))
+        {
+            continue;
+        }
+        uint8_t data = spi_read(dev, addr);
+        if (data != dev->shadow[addr])
+        {
+            ESP_LOGW(TAG, "Shadow mismatch reg %02x: %02x, chip %02x", addr, dev->shadow[addr], data);
+            dev->shadow[addr] = data;
+            mismatches++;
+        }
+    }
+    dev->shadow_mismatches += mismatches;
+    return mismatches;
+}
+
+void SX1278_get_spi_stats(SX1278* dev, SpiStats* stats)
+{
+    memcpy(stats, &dev->spi_stats, sizeof(SpiStats));
+}
+
+void SX1278_reset_spi_stats(SX1278* dev)
+{
+    memset(&dev->spi_stats, 0, sizeof(SpiStats));
+}
+
+static void read_stats(SX1278* dev, void* arg)
+{
+    SX1278Stats* stats = arg;
+    memcpy(stats, &dev->stats, sizeof(SX1278Stats));
+    stats->rx_overflows = dev->rx_ring.overflows;
+    stats->spi = dev->spi_stats;
+    // The current state has been running since the last transition
+    stats->mode_dwell_us[dev->mode] += SX1278_hal_time_us() - dev->mode_since;
+}
+
+void SX1278_get_stats(SX1278* dev, SX1278Stats* stats)
+{
+    // A snapshot between two worker steps, a frame counted here is already in the ring
+    call_on_worker(dev, read_stats, stats);
+}
+
+static void clear_stats(SX1278* dev, void* arg)
+{
+    memset(&dev->stats, 0, sizeof(SX1278Stats));
+    memset(&dev->spi_stats, 0, sizeof(SpiStats));
+    dev->rx_ring.overflows = 0;
+    dev->mode_since = SX1278_hal_time_us();
+}
+
+void SX1278_reset_stats(SX1278* dev)
+{
+    call_on_worker(dev, clear_stats, NULL);
+}
+
+uint32_t SX1278_trace_read(SX1278* dev, TraceRecord* records, uint32_t max)
+{
+#ifdef CONFIG_SX1278_TRACE
+    uint32_t head = dev->trace_head;
+    uint32_t count = head < CONFIG_SX1278_TRACE_LENGTH ? head : CONFIG_SX1278_TRACE_LENGTH;
+    count = count < max ? count : max;
+    // Oldest first, ending with the most recent event
+    for (uint32_t i = 0; i < count; i++)
+    {
+        records[i] = dev->trace[(head - count + i) % CONFIG_SX1278_TRACE_LENGTH];
+    }
+    return count;
+#else
+    return 0;
+#endif
+}
+
+void SX1278_trace_dump(SX1278* dev)
+{
+#ifdef CONFIG_SX1278_TRACE
+    static const char* names[] = {
+        "irq", "tx start", "tx done", "rx start", "rx done", "rx timeout",
+        "crc error", "header error", "cad start", "cad done", "switch mode",
+    };
+    TraceRecord records[CONFIG_SX1278_TRACE_LENGTH];
+    uint32_t count = SX1278_trace_read(dev, records, CONFIG_SX1278_TRACE_LENGTH);
+    printf("-----------------------------------------------------------------\n");
+    for (uint32_t i = 0; i < count; i++)
+    {
+        printf("%10u %-12s mode %u arg %02x\n", (unsigned) records[i].timestamp, names[records[i].event], records[i].mode, records[i].arg);
+    }
+    printf("-----------------------------------------------------------------\n");
+#else
+    ESP_LOGW(TAG, "Tracing is disabled, enable CONFIG_SX1278_TRACE");
+#endif
+}
+
+static uint8_t wait_ready(SX1278* dev)
+{
+    uint32_t start = SX1278_hal_time_us();
+    // The version register only reads back once the chip is out of reset
+    while (spi_read(dev, REG_VERSION) != CHIP_VERSION)
+    {
+        if (SX1278_hal_time_us() - start > READY_TIMEOUT_US)
+        {
+            return 0;
+        }
+        SX1278_hal_delay_us(READY_POLL_US);
+    }
+    return 1;
+}
+
+uint8_t SX1278_reset(SX1278* dev)
+{
+    int pin = dev->config.reset_pin;
+    if (pin != SX1278_PIN_UNUSED)
+    {
+        memset(dev->shadow_valid, 0, sizeof(dev->shadow_valid));
+        SX1278_hal_gpio_output(pin);
+        SX1278_hal_gpio_set_level(pin, 0);
+        SX1278_hal_delay_us(RESET_PULSE_US);
+        SX1278_hal_gpio_set_level(pin, 1);
+    }
+    return wait_ready(dev);
+}
+
+static uint8_t warm_start(SX1278* dev)
+{
+    // Registers survive deep sleep as long as the chip stays powered
+    if (!wait_ready(dev))
+    {
+        return 0;
+    }
+    uint8_t regs[SX1278_SHADOW_SIZE - REG_OPMODE];
+    read_burst_access(dev, REG_OPMODE, regs, sizeof(regs));
+    uint8_t mode = regs[0];
+    if (mode != SLEEP_MODE_DEFAULT && mode != STANDBY_MODE_DEFAULT)
+    {
+        memset(dev->shadow_valid, 0, sizeof(dev->shadow_valid));
+        return 0;
+    }
+    set_mode(dev, mode == SLEEP_MODE_DEFAULT ? Sleep : Standby);
+    return 1;
+}
+
+uint32_t SX1278_get_ready_us(SX1278* dev)
+{
+    return dev->ready_us;
+}
+
+static void on_dio(void* p)
+{
+    SX1278* dev = p;
+    Command cmd = { .type = CommandIrq, .timestamp = SX1278_hal_time_us() };
+    if (!SX1278_hal_queue_send_from_isr(dev->cmd_queue, &cmd))
+    {
+        dev->stats.irq_dropped++;
+    }
+}
+
+void SX1278_prepare_fifo(SX1278* dev, uint8_t len)
+{
+    dev->expected_size = len;
+}
+
+static void debug(SX1278* dev)
+{
+    printf("-----------------------------------------------------------------\n");
+    printf("mode: %02x\n", read_single_access(dev, REG_OPMODE));
+    printf("config1: %02x\n", read_single_access(dev, REG_MODEM_CONFIG1));
+    printf("config2: %02x\n", read_single_access(dev, REG_MODEM_CONFIG2));
+    printf("freq: %02x%02x%02x\n", read_single_access(dev, REG_FR_MSB), read_single_access(dev, REG_FR_MID), read_single_access(dev, REG_FR_LSB));
+    printf("inv iq: %02x\n", read_single_access(dev, REG_INVERT_IQ));
+    printf("inv iq 2: %02x\n", read_single_access(dev, REG_INVERT_IQ2));
+    printf("pa: %02x\n", read_single_access(dev, REG_PA_CONFIG));
+    printf("sync: %02x\n", read_single_access(dev, REG_SYNC_WORD));
+    printf("-----------------------------------------------------------------\n");
+}
+
+static void notify_user(SX1278Task handle)
+{
+    if (handle != NULL)
+    {
+        SX1278_hal_task_notify(handle);
+    }
+}
+
+static void complete_op(SX1278Op* op, OpStatus status)
+{
+    if (op == NULL)
+    {
+        return;
+    }
+    op->status = status;
+    if (op->callback != NULL)
+    {
+        op->callback(op, op->arg);
+    }
+    // Once done is set the owner may reuse the operation, nothing in it can be touched afterwards
+    SX1278_hal_enter_critical();
+    SX1278Task waiter = op->waiter;
+    op->done = 1;
+    SX1278_hal_exit_critical();
+    notify_user(waiter);
+}
+
+static void complete_rx(SX1278* dev, OpStatus status)
+{
+    SX1278Op* op = dev->rx_op;
+    if (op == NULL)
+    {
+        return;
+    }
+    dev->rx_op = NULL;
+    dev->rx_buffer = NULL;
+    if (status == OpDone)
+    {
+        op->packet = dev->pkt_status;
+    }
+    complete_op(op, status);
+}
+
+static void enter_standby(SX1278* dev)
+{
+    // The chip drops back to Standby by itself after TxDone, RxSingle and CadDone
+    set_mode(dev, Standby);
+    shadow_store(dev, REG_OPMODE, STANDBY_MODE_DEFAULT);
+}
+
+static void map_dio(SX1278* dev, uint8_t mapping)
+{
+    write_changed(dev, REG_DIO_MAPPING_1, mapping);
+}
+
+static void lock_synth(SX1278* dev, OperationMode fs_mode)
+{
+    // The PLL locks in the background while the FIFO and DIO mapping are set up
+    if (dev->mode != fs_mode)
+    {
+        write_single_access(dev, REG_OPMODE, LORA_MODE | fs_mode);
+        set_mode(dev, fs_mode);
+    }
+}
+
+static void load_reply(SX1278* dev)
+{
+    write_changed(dev, REG_FIFO_TX_BASE_ADDR, TX_BASE_FIFO_ADDR);
+    write_single_access(dev, REG_FIFO_ADDR_PTR, TX_BASE_FIFO_ADDR);
+    write_burst_access(dev, REG_FIFO, dev->reply, dev->reply_size);
+    dev->reply_loaded = 1;
+}
+
+static void stream_reset(SX1278* dev)
+{
+    SX1278_pool_free(dev->stream_packet);
+    dev->stream_packet = NULL;
+    dev->stream_dst = NULL;
+}
+
+static void stream_begin(SX1278* dev)
+{
+    RxRing* ring = &dev->rx_ring;
+    uint8_t* dst = dev->rx_buffer;
+    if (dst == NULL)
+    {
+        // Without a free ring slot the frame is left to the usual RxDone path
+        PacketBuffer* packet = ring->head - ring->tail < SX1278_RX_RING_LENGTH ? SX1278_pool_alloc() : NULL;
+        if (packet == NULL)
+        {
+            return;
+        }
+        dev->stream_packet = packet;
+        dst = packet->payload;
+    }
+    // REG_FIFO_RX_BYTE_ADDR is the last byte written and still points into the previous frame
+    dev->stream_start = dev->rx_next;
+    dev->stream_mark = read_single_access(dev, REG_FIFO_RX_BYTE_ADDR);
+    dev->stream_read = 0;
+    dev->stream_dst = dst;
+}
+
+static void stream_drain(SX1278* dev)
+{
+    uint8_t last = read_single_access(dev, REG_FIFO_RX_BYTE_ADDR);
+    if (last == dev->stream_mark)
+    {
+        // Nothing of this frame has been written yet
+        return;
+    }
+    uint8_t written = last + 1 - dev->stream_start;
+    if (written <= dev->stream_read)
+    {
+        return;
+    }
+    write_single_access(dev, REG_FIFO_ADDR_PTR, dev->stream_start + dev->stream_read);
+    read_burst_access(dev, REG_FIFO, dev->stream_dst + dev->stream_read, written - dev->stream_read);
+    dev->stats.rx_stream_bytes += written - dev->stream_read;
+    dev->stream_read = written;
+}
+
+static void set_frf(SX1278* dev, uint32_t frf)
+{
+    const uint8_t bytes[] = { (frf >> 16) & 0xff, (frf >> 8) & 0xff, frf & 0xff };
+    if (!(shadow_hit(dev, REG_FR_MSB) && shadow_hit(dev, REG_FR_MID) && shadow_hit(dev, REG_FR_LSB)
+        && memcmp(&dev->shadow[REG_FR_MSB], bytes, sizeof(bytes)) == 0))
+    {
+        write_burst_access(dev, REG_FR_MSB, bytes, sizeof(bytes));
+    }
+}
+
+static void hop(SX1278* dev)
+{
+    // The chip has already moved on to the next channel index, the PLL must follow before the next hop
+    uint8_t channel = read_single_access(dev, REG_HOP_CHANNEL) & HOP_CHANNEL_MASK;
+    set_frf(dev, dev->hop_table[channel % dev->hop_count]);
+    write_single_access(dev, REG_IRQ_FLAGS, FHSS_CHANGE_CHANNEL_MASK);
+    dev->stats.hops++;
+}
+
+static void transmit(SX1278* dev, const uint8_t* data, uint8_t len)
+{
+    if (dev->mode == RxSingle)
+    {
+        complete_rx(dev, OpAborted);
+    }
+    stream_reset(dev);
+    lock_synth(dev, Fstx);
+    if (dev->hop_count > 0)
+    {
+        set_frf(dev, dev->hop_table[0]);
+        map_dio(dev, DIO0_TX_DONE | DIO1_FHSS_CHANGE_CHANNEL);
+    }
+    else
+    {
+        map_dio(dev, DIO0_TX_DONE);
+    }
+    // A staged reply is in the upper FIFO half already
+    if (data != NULL)
+    {
+        write_changed(dev, REG_FIFO_TX_BASE_ADDR, TX_BASE_FIFO_ADDR);
+        write_single_access(dev, REG_FIFO_ADDR_PTR, TX_BASE_FIFO_ADDR);
+        write_burst_access(dev, REG_FIFO, data, len);
+        dev->reply_loaded = 0;
+    }
+    // Fixed-length implicit frames find the length in place already
+    write_changed(dev, REG_PAYLOAD_LENGTH, len);
+    write_single_access(dev, REG_OPMODE, LORA_TX_MODE);
+    set_mode(dev, Tx);
+    TRACE(dev, TraceTxStart, len);
+    // debug();
+}
+
+static void release_tx_buffer(const uint8_t* data)
+{
+    // Caller-owned buffers are not in the pool and stay with the caller
+    SX1278_pool_free(SX1278_pool_from_payload(data));
+}
+
+static void handle_cad_start(SX1278* dev)
+{
+    if (dev->mode == RxSingle)
+    {
+        complete_rx(dev, OpAborted);
+    }
+    stream_reset(dev);
+    write_single_access(dev, REG_OPMODE, STANDBY_MODE_DEFAULT);
+    map_dio(dev, DIO0_CAD_DONE | DIO1_CAD_DETECTED);
+    write_single_access(dev, REG_OPMODE, LORA_MODE | Cad);
+    set_mode(dev, Cad);
+    TRACE(dev, TraceCadStart, 0);
+}
+
+static void lbt_sense(SX1278* dev)
+{
+    // A continuous receiver is put back into RX once the frame is out
+    if (dev->mode == RxContinuous)
+    {
+        dev->resume_rx = 1;
+    }
+    dev->lbt_backoff = 0;
+    dev->lbt_cad = 1;
+    handle_cad_start(dev);
+}
+
+static uint8_t transmit_next_queued(SX1278* dev)
+{
+    TxRequest request;
+    // A frame still waiting for a clear channel goes first, a scan holds the queue back
+    if (dev->tx_inflight != NULL || dev->scan_job != NULL || !SX1278_hal_queue_receive(dev->tx_queue, &request, 0))
+    {
+        return 0;
+    }
+    dev->tx_inflight = request.data;
+    dev->tx_inflight_size = request.size;
+    dev->tx_op = request.op;
+    if (dev->lbt.enabled)
+    {
+        dev->lbt_attempt = 0;
+        lbt_sense(dev);
+    }
+    else
+    {
+        transmit(dev, request.data, request.size);
+    }
+    return 1;
+}
+
+static void handle_tx_queued(SX1278* dev)
+{
+    if (dev->scan_job != NULL)
+    {
+        // Sent when the scan ends
+        return;
+    }
+    switch (dev->mode)
+    {
+    case Tx:
+    case Cad:
+        // Picked up when the current operation completes
+        break;
+    case RxContinuous:
+        dev->resume_rx = 1;
+        transmit_next_queued(dev);
+        break;
+    default:
+        transmit_next_queued(dev);
+        break;
+    }
+}
+
+static void handle_rx_start(SX1278* dev, OperationMode rx_mode, HeaderMode header_mode, uint8_t* buffer)
+{
+    // The chip takes the header mode from the profile, ValidHeader only exists with an explicit header
+    dev->header_mode = read_single_access(dev, REG_MODEM_CONFIG1) & HEADER_MODE_MASK;
+    uint8_t stream = dev->rx_streaming && dev->header_mode == ExplicitHeaderMode ? DIO3_VALID_HEADER : 0;
+    if (header_mode != dev->header_mode)
+    {
+        ESP_LOGW(TAG, "RX header mode %u differs from the profile, see SX1278_set_implicit_header", header_mode);
+    }
+    stream_reset(dev);
+    dev->rx_buffer = buffer;
+    // Entering RX puts the chip's write pointer back at the RX base
+    dev->rx_next = BASE_FIFO_ADDR;
+    lock_synth(dev, Fxrx);
+    if (dev->reply != NULL && !dev->reply_loaded)
+    {
+        load_reply(dev);
+    }
+    write_changed(dev, REG_FIFO_RX_BASE_ADDR, BASE_FIFO_ADDR);
+    write_single_access(dev, REG_FIFO_ADDR_PTR, BASE_FIFO_ADDR);
+    if (dev->header_mode == ImplicitHeaderMode)
+    {
+        ESP_ERROR_CHECK_WITHOUT_ABORT(dev->expected_size == 0);
+        write_changed(dev, REG_PAYLOAD_LENGTH, dev->expected_size);
+    }
+    // RxSingle keeps its timeout on DIO1, hops are then signalled on DIO2 only
+    if (dev->hop_count > 0)
+    {
+        set_frf(dev, dev->hop_table[0]);
+        map_dio(dev, (rx_mode == RxContinuous ? DIO0_RX_DONE | DIO1_FHSS_CHANGE_CHANNEL : DIO0_RX_DONE) | stream);
+    }
+    else
+    {
+        map_dio(dev, DIO0_RX_DONE | stream);
+    }
+    switch (rx_mode)
+    {
+    case RxContinuous: write_single_access(dev, REG_OPMODE, LORA_RX_CONTINUOUS_MODE); break;
+    case RxSingle: write_single_access(dev, REG_OPMODE, LORA_RX_SINGLE_MODE); break;
+    default: ESP_ERROR_CHECK(1); break;
+    }
+    set_mode(dev, rx_mode);
+    TRACE(dev, TraceRxStart, header_mode);
+    dev->rx_header_mode = header_mode;
+}
+
+static void handle_switch_mode(SX1278* dev, OperationMode mode)
+{
+    OperationMode previous = dev->mode;
+    dev->resume_rx = 0;
+    stream_reset(dev);
+    // An interrupted listen-before-talk CAD is simply run again
+    if (dev->lbt_cad)
+    {
+        dev->lbt_cad = 0;
+        dev->lbt_backoff = 1;
+        dev->lbt_resume_us = SX1278_hal_time_us();
+    }
+    write_single_access(dev, REG_OPMODE, LORA_MODE | mode);
+    set_mode(dev, mode);
+    TRACE(dev, TraceSwitchMode, previous);
+    // Wake a continuous receiver only once the radio has really left RX
+    if (previous == RxContinuous)
+    {
+        notify_user(dev->rx_done_handle);
+    }
+}
+
+static void reply_check_overlap(SX1278* dev, uint8_t start, uint8_t size)
+{
+    // A long frame, or many in RxContinuous, can run into the upper half where the reply waits
+    if ((uint8_t)(TX_BASE_FIFO_ADDR - start) < size || (uint8_t)(start - TX_BASE_FIFO_ADDR) < dev->reply_size)
+    {
+        dev->reply_loaded = 0;
+    }
+}
+
+static void send_reply(SX1278* dev, uint32_t timestamp)
+{
+    if (!dev->reply_loaded)
+    {
+        load_reply(dev);
+    }
+    dev->replying = 1;
+    transmit(dev, NULL, dev->reply_size);
+    uint32_t turnaround = SX1278_hal_time_us() - timestamp;
+    dev->stats.replies++;
+    dev->stats.turnaround_us = turnaround;
+    if (turnaround > dev->stats.turnaround_max_us)
+    {
+        dev->stats.turnaround_max_us = turnaround;
+    }
+}
+
+static uint8_t in_reply_area(SX1278* dev, uint8_t addr)
+{
+    return dev->reply != NULL && (uint8_t)(addr - TX_BASE_FIFO_ADDR) < dev->reply_size;
+}
+
+// Reads the bytes [from, to) of the frame at start that lie inside, or outside, the reply area
+static void read_frame(SX1278* dev, uint8_t* payload, uint8_t start, uint8_t from, uint8_t to, uint8_t inside)
+{
+    uint8_t i = from;
+    while (i < to)
+    {
+        uint8_t end = i;
+        while (end < to && in_reply_area(dev, start + end) == inside)
+        {
+            end++;
+        }
+        if (end > i)
+        {
+            write_single_access(dev, REG_FIFO_ADDR_PTR, start + i);
+            read_burst_access(dev, REG_FIFO, payload + i, end - i);
+        }
+        i = end;
+        while (i < to && in_reply_area(dev, start + i) != inside)
+        {
+            i++;
+        }
+    }
+}
+
+static void read_packet(SX1278* dev, uint8_t* payload, PacketStatus* status, uint32_t timestamp)
+{
+    uint8_t pfifo = read_single_access(dev, REG_FIFO_RX_CURRENT_ADDR);
+    status->size = dev->header_mode == 0 ? read_single_access(dev, REG_RX_NB_BYTES) : read_single_access(dev, REG_PAYLOAD_LENGTH);
+    uint8_t done = 0;
+    // What the stream drained while the frame was on air is not read again
+    if (payload == dev->stream_dst && pfifo == dev->stream_start && dev->stream_read <= status->size)
+    {
+        done = dev->stream_read;
+    }
+    // The reply goes out first, only the bytes it is loaded over are read before that
+    if (dev->reply != NULL)
+    {
+        read_frame(dev, payload, pfifo, done, status->size, 1);
+        reply_check_overlap(dev, pfifo, status->size);
+        send_reply(dev, timestamp);
+    }
+    read_frame(dev, payload, pfifo, done, status->size, 0);
+
+    uint8_t rssi = read_single_access(dev, REG_PKT_RSSI_VALUE);
+    if (dev->settings.channel_freq > MID_RANGE_FREQ_THRESHOLD)
+    {
+        status->rssi = RSSI_OFFSET_HF + rssi + (rssi >> 4);
+    }
+    else
+    {
+        status->rssi = RSSI_OFFSET_LF + rssi + (rssi >> 4);
+    }
+    status->snr = (int8_t)read_single_access(dev, REG_PKT_SNR_VALUE) / 4;
+    status->timestamp = timestamp;
+}
+
+static void handle_rx_done(SX1278* dev, uint8_t flags, uint32_t timestamp)
+{
+    uint8_t valid_crc, required_crc;
+    OpStatus status = OpDone;
+    OperationMode previous = dev->mode;
+    RxRing* ring = &dev->rx_ring;
+
+    required_crc = dev->header_mode == 0 ? (read_single_access(dev, REG_HOP_CHANNEL) & CRC_ON_PAYLOAD_MASK) : (read_single_access(dev, REG_MODEM_CONFIG2) & RX_PAYLOAD_CRC_ON_MASK);
+    valid_crc = (flags & PAYLOAD_CRC_ERROR_MASK) != 0 && required_crc != 0;
+    // Without a header there is no ValidHeader either
+    if (dev->header_mode == ExplicitHeaderMode && (flags & VALID_HEADER_MASK) == 0)
+    {
+        dev->stats.header_errors++;
+        status = OpCrcError;
+        TRACE(dev, TraceHeaderError, flags);
+    }
+    else if (valid_crc != 0)
+    {
+        dev->stats.crc_errors++;
+        status = OpCrcError;
+        TRACE(dev, TraceCrcError, flags);
+    }
+    else
+    {
+        dev->stats.rx_packets++;
+        TRACE(dev, TraceRxDone, flags);
+        // The synthesizer locks for the reply while the frame is looked at
+        if (dev->reply != NULL)
+        {
+            lock_synth(dev, Fstx);
+            if (previous == RxContinuous)
+            {
+                dev->resume_rx = 1;
+            }
+        }
+        if (dev->rx_buffer != NULL)
+        {
+            read_packet(dev, dev->rx_buffer, &dev->pkt_status, timestamp);
+            dev->rx_buffer = NULL;
+        }
+        else
+        {
+            PacketBuffer* packet = dev->stream_packet;
+            dev->stream_packet = NULL;
+            if (packet == NULL)
+            {
+                packet = ring->head - ring->tail < SX1278_RX_RING_LENGTH ? SX1278_pool_alloc() : NULL;
+            }
+            if (packet == NULL)
+            {
+                // The frame may still have run over the reply
+                ring->overflows++;
+                status = OpAborted;
+                dev->reply_loaded = 0;
+            }
+            else
+            {
+                read_packet(dev, packet->payload, &packet->status, timestamp);
+                dev->pkt_status = packet->status;
+                ring->packets[ring->head % SX1278_RX_RING_LENGTH] = packet;
+
+                MEMORY_BARRIER();
+                ring->head++;
+            }
+        }
+        if (dev->mode == RxContinuous)
+        {
+            write_single_access(dev, REG_FIFO_ADDR_PTR, BASE_FIFO_ADDR);
+        }
+    }
+    // In RxContinuous the next frame is written right after this one
+    if (dev->rx_streaming && dev->mode == RxContinuous)
+    {
+        dev->rx_next = read_single_access(dev, REG_FIFO_RX_BYTE_ADDR) + 1;
+    }
+    stream_reset(dev);
+    // Every frame starts on the first channel of the table
+    if (dev->hop_count > 0 && dev->mode == RxContinuous)
+    {
+        set_frf(dev, dev->hop_table[0]);
+    }
+
+    // debug();
+    write_single_access(dev, REG_IRQ_FLAGS, flags & (RX_DONE_MASK | VALID_HEADER_MASK | PAYLOAD_CRC_ERROR_MASK));
+    if (dev->mode == RxSingle)
+    {
+        ESP_LOGI(TAG, "Rx done");
+        enter_standby(dev);
+    }
+    else if (dev->mode == Fstx)
+    {
+        send_reply(dev, timestamp);
+    }
+    complete_rx(dev, status);
+    notify_user(dev->rx_done_handle);
+}
+
+static uint32_t sniff_interval_us(SX1278* dev)
+{
+    // A preamble has to outlast one sleep, the CAD and the receiver locking on to it
+    int32_t symbols = (int32_t)dev->settings.preamble_len - SNIFF_CAD_SYMBOLS - SNIFF_LOCK_SYMBOLS;
+    return symbols > 0 ? symbols * SX1278_toa_symbol_us(&dev->toa) : 0;
+}
+
+static void handle_sniff_start(SX1278* dev, HeaderMode header_mode)
+{
+    if (!dev->sniffing)
+    {
+        dev->sniff_symb_timeout = read_single_access(dev, REG_SYMB_TIMOUT_LSB);
+        write_single_access(dev, REG_SYMB_TIMOUT_LSB, SNIFF_RX_TIMEOUT_SYMBOLS);
+        // The duty cycle only starts from an idle radio, a running CAD is left to finish
+        if (dev->mode == RxContinuous || dev->mode == RxSingle)
+        {
+            handle_switch_mode(dev, Standby);
+        }
+    }
+    dev->sniffing = 1;
+    dev->sniff_header_mode = header_mode;
+    dev->sniff_wake_us = SX1278_hal_time_us();
+}
+
+static void stop_sniff(SX1278* dev)
+{
+    if (dev->sniffing)
+    {
+        dev->sniffing = 0;
+        dev->sniff_cad = 0;
+        write_single_access(dev, REG_SYMB_TIMOUT_LSB, dev->sniff_symb_timeout);
+    }
+}
+
+static void sniff_cad_done(SX1278* dev)
+{
+    if (!dev->sniffing)
+    {
+        return;
+    }
+    if (dev->cad_detected)
+    {
+        dev->stats.sniff_detected++;
+        handle_rx_start(dev, RxSingle, dev->sniff_header_mode, NULL);
+        return;
+    }
+    if (transmit_next_queued(dev))
+    {
+        return;
+    }
+    write_single_access(dev, REG_OPMODE, LORA_MODE | Sleep);
+    set_mode(dev, Sleep);
+    dev->sniff_wake_us = SX1278_hal_time_us() + sniff_interval_us(dev);
+}
+
+static SX1278Op* end_tx(SX1278* dev)
+{
+    SX1278Op* op;
+    if (dev->replying)
+    {
+        // A queued frame may still be backing off in tx_inflight
+        op = dev->reply_op;
+        dev->replying = 0;
+        dev->reply = NULL;
+        dev->reply_op = NULL;
+        return op;
+    }
+    op = dev->tx_op;
+    release_tx_buffer(dev->tx_inflight);
+    dev->tx_inflight = NULL;
+    dev->tx_op = NULL;
+    return op;
+}
+
+static void finish_tx(SX1278* dev, OpStatus status)
+{
+    SX1278Op* op = end_tx(dev);
+    // Re-enter TX before waking the application so the radio never idles between queued frames
+    if (!transmit_next_queued(dev) && dev->resume_rx)
+    {
+        dev->resume_rx = 0;
+        // A receive operation still waiting for its frame keeps its buffer
+        handle_rx_start(dev, RxContinuous, dev->rx_header_mode, dev->rx_buffer);
+    }
+    complete_op(op, status);
+    notify_user(dev->tx_done_handle);
+}
+
+static void abort_tx(SX1278* dev)
+{
+    // A command that takes the radio out of TX means TxDone never comes for this frame
+    if (dev->mode != Tx)
+    {
+        return;
+    }
+    write_single_access(dev, REG_OPMODE, STANDBY_MODE_DEFAULT);
+    write_single_access(dev, REG_IRQ_FLAGS, TX_DONE_MASK);
+    set_mode(dev, Standby);
+    dev->resume_rx = 0;
+    complete_op(end_tx(dev), OpAborted);
+    notify_user(dev->tx_done_handle);
+    // The rest of the queue goes after the command
+    if (SX1278_hal_queue_count(dev->tx_queue) > 0)
+    {
+        Command cmd = { .type = CommandTxQueued };
+        SX1278_hal_queue_send(dev->cmd_queue, &cmd, 0);
+    }
+}
+
+static void lbt_cad_done(SX1278* dev)
+{
+    if (!dev->cad_detected)
+    {
+        transmit(dev, dev->tx_inflight, dev->tx_inflight_size);
+        return;
+    }
+    if (++dev->lbt_attempt >= dev->lbt.max_attempts)
+    {
+        ESP_LOGW(TAG, "Channel busy, frame dropped after %u attempts", dev->lbt_attempt);
+        dev->stats.lbt_dropped++;
+        finish_tx(dev, OpAborted);
+        return;
+    }
+
+    // Binary exponential back-off in whole slots
+    uint8_t exponent = dev->lbt_attempt < LBT_MAX_EXPONENT ? dev->lbt_attempt : LBT_MAX_EXPONENT;
+    uint32_t backoff_ms = (SX1278_hal_random() % (1 << exponent) + 1) * dev->lbt.slot_ms;
+    dev->stats.lbt_backoffs++;
+    dev->stats.lbt_backoff_ms += backoff_ms;
+    dev->lbt_resume_us = SX1278_hal_time_us() + backoff_ms * 1000;
+    dev->lbt_backoff = 1;
+    if (dev->resume_rx)
+    {
+        handle_rx_start(dev, RxContinuous, dev->rx_header_mode, dev->rx_buffer);
+    }
+}
+
+static uint8_t scanning(SX1278* dev)
+{
+    return dev->scan_job != NULL && dev->scan_job->started;
+}
+
+static void handle_irq(SX1278* dev, uint32_t timestamp)
+{
+    uint8_t flags = read_single_access(dev, REG_IRQ_FLAGS);
+    TRACE(dev, TraceIrq, flags);
+    if (scanning(dev))
+    {
+        // Anything the scan received is not a frame for the application
+        write_single_access(dev, REG_IRQ_FLAGS, flags);
+        return;
+    }
+    if ((flags & FHSS_CHANGE_CHANNEL_MASK) != 0 && dev->hop_count > 0)
+    {
+        hop(dev);
+    }
+    switch (dev->mode)
+    {
+    case Tx:
+        if ((flags & TX_DONE_MASK) != 0)
+        {
+            write_single_access(dev, REG_IRQ_FLAGS, TX_DONE_MASK);
+            dev->stats.tx_packets++;
+            TRACE(dev, TraceTxDone, flags);
+            enter_standby(dev);
+            finish_tx(dev, OpDone);
+        }
+        break;
+    case RxContinuous:
+    case RxSingle:
+        if ((flags & RX_DONE_MASK) != 0)
+        {
+            handle_rx_done(dev, flags, timestamp);
+        }
+        else if ((flags & RX_TIMEOUT_MASK) != 0)
+        {
+            // ESP_LOGI(TAG, "Rx timeout");
+            dev->rx_buffer = NULL;
+            dev->stats.rx_timeouts++;
+            TRACE(dev, TraceRxTimeout, flags);
+            write_single_access(dev, REG_IRQ_FLAGS, RX_TIMEOUT_MASK);
+            enter_standby(dev);
+            // A sniffing receiver woke on noise, there is nothing to tell the application
+            if (dev->sniffing)
+            {
+                dev->stats.sniff_missed++;
+            }
+            else
+            {
+                complete_rx(dev, OpTimeout);
+                notify_user(dev->rx_done_handle);
+            }
+        }
+        else if ((flags & VALID_HEADER_MASK) != 0 && dev->rx_streaming && dev->stream_dst == NULL)
+        {
+            stream_begin(dev);
+        }
+        break;
+    case Cad:
+        if ((flags & CAD_DONE_MASK) != 0)
+        {
+            write_single_access(dev, REG_IRQ_FLAGS, flags & (CAD_DONE_MASK | CAD_DETECTED_MASK));
+            dev->cad_detected = (flags & CAD_DETECTED_MASK) != 0;
+            dev->stats.cad_runs++;
+            dev->stats.cad_busy += dev->cad_detected;
+            TRACE(dev, TraceCadDone, flags);
+            enter_standby(dev);
+            if (dev->lbt_cad)
+            {
+                dev->lbt_cad = 0;
+                lbt_cad_done(dev);
+            }
+            else if (dev->sniff_cad)
+            {
+                dev->sniff_cad = 0;
+                sniff_cad_done(dev);
+            }
+            else
+            {
+                transmit_next_queued(dev);
+                notify_user(dev->cad_done_handle);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static uint32_t lbt_poll(SX1278* dev)
+{
+    // Sensing again must not cut short a CAD, single receive or scan the application started
+    if (!dev->lbt_backoff || dev->scan_job != NULL || dev->mode == Tx || dev->mode == RxSingle || dev->mode == Cad)
+    {
+        return SX1278_WAIT_FOREVER;
+    }
+    int32_t left = (int32_t)(dev->lbt_resume_us - SX1278_hal_time_us());
+    if (left <= 0)
+    {
+        lbt_sense(dev);
+        return SX1278_WAIT_FOREVER;
+    }
+    return left / 1000 + 1;
+}
+
+static int16_t rssi_dbm(uint32_t frf, uint8_t raw)
+{
+    return (frf > MID_RANGE_FREQ_THRESHOLD ? RSSI_OFFSET_HF : RSSI_OFFSET_LF) + raw;
+}
 
-static const char* TAG = "SX1278";
+static void scan_channel(SX1278* dev, ScanJob* job)
+{
+    write_single_access(dev, REG_OPMODE, STANDBY_MODE_DEFAULT);
+    set_frf(dev, job->plan->frf[job->channel]);
+    write_single_access(dev, REG_OPMODE, LORA_RX_CONTINUOUS_MODE);
+    job->sample = 0;
+    job->sum = 0;
+    job->sample_us = SX1278_hal_time_us() + job->dwell_us / SCAN_SAMPLES;
+}
 
+static void start_scan(SX1278* dev, ScanJob* job)
+{
+    // Channels the scan does not get to stay at INT16_MAX
+    for (uint8_t i = 0; i < job->plan->count; i++)
+    {
+        job->rssi[i] = INT16_MAX;
+    }
+    job->quietest = 0;
+    job->started = 0;
+    job->channel = 0;
+    dev->scan_job = job;
+}
 
-uint8_t read_single_access(uint8_t addr)
+static void end_scan(SX1278* dev, uint8_t resume)
 {
-    uint32_t miso;
-    spi_trans_t trans = {0};
-    uint16_t cmd = ((uint16_t) 0 << 7) | ((uint16_t)addr);
+    ScanJob* job = dev->scan_job;
+    if (job == NULL)
+    {
+        return;
+    }
+    dev->scan_job = NULL;
+    if (job->started)
+    {
+        write_single_access(dev, REG_OPMODE, STANDBY_MODE_DEFAULT);
+        write_single_access(dev, REG_IRQ_FLAGS, 0xff);
+        set_frf(dev, dev->settings.channel_freq);
+        set_mode(dev, Standby);
+        if (resume && job->previous == RxContinuous)
+        {
+            handle_rx_start(dev, RxContinuous, dev->rx_header_mode, dev->rx_buffer);
+        }
+    }
+    // The job belongs to the scanning task again from here on
+    finish_sync(dev);
+    if (SX1278_hal_queue_count(dev->tx_queue) == 0)
+    {
+        return;
+    }
+    // Frames held back by the scan go now, or after the command that cut it short
+    if (resume)
+    {
+        handle_tx_queued(dev);
+    }
+    else
+    {
+        Command cmd = { .type = CommandTxQueued };
+        SX1278_hal_queue_send(dev->cmd_queue, &cmd, 0);
+    }
+}
 
-    trans.cmd = &cmd;
-    trans.bits.cmd = 8;
-    trans.miso = &miso;
-    trans.bits.miso = 8;
+static uint32_t scan_poll(SX1278* dev)
+{
+    ScanJob* job = dev->scan_job;
+    if (job == NULL)
+    {
+        return SX1278_WAIT_FOREVER;
+    }
+    if (!job->started)
+    {
+        // A frame or CAD already under way finishes first
+        if (dev->mode == Tx || dev->mode == Cad)
+        {
+            return SX1278_WAIT_FOREVER;
+        }
+        if (job->plan->count == 0)
+        {
+            end_scan(dev, 1);
+            return SX1278_WAIT_FOREVER;
+        }
+        job->started = 1;
+        job->previous = dev->mode;
+        set_mode(dev, RxContinuous);
+        scan_channel(dev, job);
+    }
 
-    spi_trans(HSPI_HOST, &trans);
-    return miso;
+    // Samples spread over the dwell time are averaged, the worker waits for each one
+    while (1)
+    {
+        int32_t left = (int32_t)(job->sample_us - SX1278_hal_time_us());
+        if (left > 0)
+        {
+            return left / 1000 + 1;
+        }
+        job->sum += rssi_dbm(job->plan->frf[job->channel], read_single_access(dev, REG_RSSI_VALUE));
+        if (++job->sample < SCAN_SAMPLES)
+        {
+            job->sample_us += job->dwell_us / SCAN_SAMPLES;
+            continue;
+        }
+        job->rssi[job->channel] = job->sum / SCAN_SAMPLES;
+        if (job->rssi[job->channel] < job->rssi[job->quietest])
+        {
+            job->quietest = job->channel;
+        }
+        if (++job->channel >= job->plan->count)
+        {
+            break;
+        }
+        scan_channel(dev, job);
+    }
+    end_scan(dev, 1);
+    return SX1278_WAIT_FOREVER;
 }
 
-void write_single_access(uint8_t addr, uint8_t data)
+static void handle_stage_reply(SX1278* dev, void* arg)
 {
-    uint32_t mosi = data;
-    spi_trans_t trans = {0};
-    uint16_t cmd = ((uint16_t) 1 << 7) | ((uint16_t)addr);
-
-    trans.cmd = &cmd;
-    trans.bits.cmd = 8;
-    trans.mosi = &mosi;
-    trans.bits.mosi = 8;
+    ReplyJob* job = arg;
+    if (dev->replying)
+    {
+        complete_op(job->op, OpAborted);
+        return;
+    }
+    complete_op(dev->reply_op, OpAborted);
+    dev->reply = job->data;
+    dev->reply_size = job->size;
+    dev->reply_op = job->op;
+    dev->reply_loaded = 0;
+    // A frame on air is still read out of the FIFO, the reply is loaded when RX starts instead
+    if (dev->mode != Tx)
+    {
+        load_reply(dev);
+    }
+}
 
-    spi_trans(HSPI_HOST, &trans);
+static uint32_t sniff_poll(SX1278* dev)
+{
+    // Frames waiting to go out keep the radio awake
+    if (!dev->sniffing || dev->tx_inflight != NULL || (dev->mode != Sleep && dev->mode != Standby))
+    {
+        return SX1278_WAIT_FOREVER;
+    }
+    int32_t left = (int32_t)(dev->sniff_wake_us - SX1278_hal_time_us());
+    if (left <= 0)
+    {
+        dev->sniff_cad = 1;
+        handle_cad_start(dev);
+        return SX1278_WAIT_FOREVER;
+    }
+    return left / 1000 + 1;
 }
 
-void write_burst_access(uint8_t addr, uint8_t* data, uint8_t len)
+static uint32_t stream_poll(SX1278* dev)
 {
-    uint8_t size = len / 4 + 1;
-    uint32_t* mosi = malloc(sizeof(uint32_t) * size);
-    spi_trans_t trans = {0};
-    uint16_t cmd = ((uint16_t) 1 << 7) | ((uint16_t)addr);
+    if (dev->stream_dst == NULL)
+    {
+        return SX1278_WAIT_FOREVER;
+    }
+    // Nothing signals FIFO progress, so it is read every few symbols until RxDone
+    stream_drain(dev);
+    uint32_t ms = SX1278_toa_symbol_us(&dev->toa) * STREAM_POLL_SYMBOLS / 1000;
+    return ms > 0 ? ms : 1;
+}
 
-    uint32_t* pmosi = mosi;
-    for (uint8_t i = 0; i < size; i++)
+static void SX1278_worker(void* p)
+{
+    SX1278* dev = p;
+    Command cmd;
+    uint32_t wait;
+    while (1)
     {
-        if (i == size - 1)
+        uint32_t backoff = lbt_poll(dev);
+        uint32_t sniff = sniff_poll(dev);
+        uint32_t stream = stream_poll(dev);
+        uint32_t scan = scan_poll(dev);
+        backoff = sniff < backoff ? sniff : backoff;
+        backoff = stream < backoff ? stream : backoff;
+        backoff = scan < backoff ? scan : backoff;
+        // A busy radio is re-polled after a while in case a DIO edge was missed
+        wait = dev->mode == Tx || dev->mode == RxContinuous || dev->mode == RxSingle || dev->mode == Cad
+            ? DIO_IRQ_FALLBACK_MS
+            : SX1278_WAIT_FOREVER;
+        wait = backoff < wait ? backoff : wait;
+        if (!SX1278_hal_queue_receive(dev->cmd_queue, &cmd, wait))
         {
-            memcpy(pmosi, data, sizeof(uint8_t) * (len % 4));
+            cmd.type = CommandIrq;
+            cmd.timestamp = SX1278_hal_time_us();
         }
-        else
+        else if (cmd.type == CommandIrq)
         {
-            memcpy(pmosi, data, sizeof(uint32_t));
+            record_latency(dev, SX1278_hal_time_us() - cmd.timestamp);
         }
-        pmosi += 4;
-        data += 4;
-    }
 
-    trans.cmd = &cmd;
-    trans.bits.cmd = 8;
-    trans.mosi = mosi;
-    trans.bits.mosi = 8 * len;
-
-    spi_trans(HSPI_HOST, &trans);
+        switch (cmd.type)
+        {
+        case CommandIrq: handle_irq(dev, cmd.timestamp); break;
+        case CommandTxQueued: handle_tx_queued(dev); break;
+        case CommandRx:
+            end_scan(dev, 0);
+            abort_tx(dev);
+            stop_sniff(dev);
+            complete_rx(dev, OpAborted);
+            handle_rx_start(dev, cmd.mode, cmd.header_mode, cmd.buffer);
+            dev->rx_op = cmd.job;
+            break;
+        case CommandCad: end_scan(dev, 0); abort_tx(dev); stop_sniff(dev); complete_rx(dev, OpAborted); handle_cad_start(dev); break;
+        case CommandSniff:
+            end_scan(dev, 0);
+            abort_tx(dev);
+            complete_rx(dev, OpAborted);
+            stream_reset(dev);
+            handle_sniff_start(dev, cmd.header_mode);
+            break;
+        case CommandScan:
+            stop_sniff(dev);
+            complete_rx(dev, OpAborted);
+            stream_reset(dev);
+            start_scan(dev, cmd.job);
+            break;
+        case CommandSwitchMode: end_scan(dev, 0); abort_tx(dev); stop_sniff(dev); complete_rx(dev, OpAborted); handle_switch_mode(dev, cmd.mode); break;
+        case CommandCall:
+            cmd.call(dev, cmd.job);
+            finish_sync(dev);
+            break;
+        case CommandStop:
+            // Nothing of the device is touched past this point, destroy can tear it down
+            finish_sync(dev);
+            SX1278_hal_task_exit();
+            break;
+        }
+    }
+}
 
-    free(mosi);
+PacketBuffer* SX1278_rx_peek(SX1278* dev)
+{
+    RxRing* ring = &dev->rx_ring;
+    if (ring->head == ring->tail)
+    {
+        return NULL;
+    }
+    MEMORY_BARRIER();
+    return ring->packets[ring->tail % SX1278_RX_RING_LENGTH];
 }
 
-void SX1278_reset()
+void SX1278_rx_release(SX1278* dev)
 {
-    gpio_config_t io_conf;
-    io_conf.intr_type = GPIO_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_OUTPUT;
-    io_conf.pin_bit_mask = 1ULL<<DEFAULT_SX1278_RESET_PIN;
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 0;
-    
-    gpio_config(&io_conf);
-    gpio_set_level(DEFAULT_SX1278_RESET_PIN, 1);
-    vTaskDelay(1 / portTICK_PERIOD_MS);
-    gpio_set_level(DEFAULT_SX1278_RESET_PIN, 0);
-    vTaskDelay(1 / portTICK_PERIOD_MS);
-    gpio_set_level(DEFAULT_SX1278_RESET_PIN, 1);
-    vTaskDelay(5 / portTICK_PERIOD_MS);
+    RxRing* ring = &dev->rx_ring;
+    if (ring->head != ring->tail)
+    {
+        SX1278_pool_free(ring->packets[ring->tail % SX1278_RX_RING_LENGTH]);
+        MEMORY_BARRIER();
+        ring->tail++;
+    }
 }
 
-void SX1278_fill_fifo(SX1278* dev, uint8_t* data, uint8_t len)
+PacketBuffer* SX1278_rx_take(SX1278* dev)
 {
-    uint16_t size = dev->fifo.size + len;
-    ESP_ERROR_CHECK(size >= MAX_FIFO_BUFFER);
-    memcpy(dev->fifo.buffer + dev->fifo.size, data, len);
-    dev->fifo.size = size;
+    // Like peek and release, but the pool block now belongs to the caller
+    PacketBuffer* packet = SX1278_rx_peek(dev);
+    if (packet != NULL)
+    {
+        MEMORY_BARRIER();
+        dev->rx_ring.tail++;
+    }
+    return packet;
 }
 
-void SX1278_prepare_fifo(SX1278* dev, uint8_t len)
+uint32_t SX1278_rx_available(SX1278* dev)
 {
-    dev->fifo.expected_size = len;
+    return dev->rx_ring.head - dev->rx_ring.tail;
 }
 
-static void debug()
+uint32_t SX1278_rx_overflows(SX1278* dev)
 {
-    printf("-----------------------------------------------------------------\n");
-    printf("mode: %02x\n", read_single_access(REG_OPMODE));
-    printf("config1: %02x\n", read_single_access(REG_MODEM_CONFIG1));
-    printf("config2: %02x\n", read_single_access(REG_MODEM_CONFIG2));
-    printf("freq: %02x%02x%02x\n", read_single_access(REG_FR_MSB), read_single_access(REG_FR_MID), read_single_access(REG_FR_LSB));
-    printf("inv iq: %02x\n", read_single_access(REG_INVERT_IQ));
-    printf("inv iq 2: %02x\n", read_single_access(REG_INVERT_IQ2));
-    printf("pa: %02x\n", read_single_access(REG_PA_CONFIG));
-    printf("sync: %02x\n", read_single_access(REG_SYNC_WORD));
-    printf("-----------------------------------------------------------------\n");
+    return dev->rx_ring.overflows;
 }
 
-void SX1278_wait_for_tx_done(void* p)
+uint8_t SX1278_get_fifo(SX1278* dev, uint8_t* data)
 {
-    SX1278* dev = p;
-    uint8_t flags;
-    while (1)
+    PacketBuffer* packet = SX1278_rx_peek(dev);
+    if (packet == NULL)
     {
-        vTaskDelay(300 / portTICK_PERIOD_MS);
-        flags = read_single_access(REG_IRQ_FLAGS);
-        if ((flags & TX_DONE_MASK) != 0)
-        {
-            xTaskNotifyGive(dev->tx_done_handle);
-            write_single_access(REG_IRQ_FLAGS, flags & (TX_DONE_MASK ^ 1));
-            vTaskDelete(tx_done_handle);
-        }
-        vTaskDelay(100 / portTICK_PERIOD_MS);
+        return 0;
     }
+    uint8_t size = packet->status.size;
+    memcpy(data, packet->payload, size);
+    SX1278_rx_release(dev);
+    return size;
+}
+
+uint8_t* SX1278_tx_lease(SX1278* dev)
+{
+    PacketBuffer* buffer = SX1278_pool_alloc();
+    return buffer != NULL ? buffer->payload : NULL;
 }
 
-void SX1278_start_tx(SX1278* dev)
+static void op_arm(SX1278Op* op)
 {
-    write_single_access(REG_OPMODE, STANDBY_MODE_DEFAULT);
-    write_single_access(REG_FIFO_TX_BASE_ADDR, BASE_FIFO_ADDR);
-    write_single_access(REG_FIFO_ADDR_PTR, BASE_FIFO_ADDR);
-    for (uint8_t i = 0; i < dev->fifo.size; i++)
+    if (op != NULL)
     {
-        write_single_access(REG_FIFO, dev->fifo.buffer[i]);
+        op->status = OpPending;
+        op->waiter = NULL;
+        op->done = 0;
     }
-    write_single_access(REG_PAYLOAD_LENGTH, dev->fifo.size);
-    write_single_access(REG_OPMODE, LORA_TX_MODE);
-    // debug();
-    xTaskCreate(SX1278_wait_for_tx_done, "tx_done", 1024, (void*)dev, tskIDLE_PRIORITY, &tx_done_handle);
 }
 
-void SX1278_wait_for_rx_done(void* p)
+void SX1278_op_init(SX1278Op* op, SX1278OpCallback callback, void* arg)
 {
-    SX1278* dev = p;
-    uint8_t flags, valid_crc, required_crc, pfifo;
-    uint8_t hmode = read_single_access(REG_MODEM_CONFIG1) & HEADER_MODE_MASK;
-    uint8_t rxmode = read_single_access(REG_OPMODE) & OPERATION_MODE_MASK; 
-    while (1)
+    memset(op, 0, sizeof(SX1278Op));
+    op->callback = callback;
+    op->arg = arg;
+}
+
+OpStatus SX1278_op_wait(SX1278Op* op, uint32_t timeout_ms)
+{
+    uint32_t start = SX1278_hal_time_us();
+    uint32_t left = timeout_ms;
+    SX1278_hal_enter_critical();
+    uint8_t done = op->done;
+    op->waiter = done ? NULL : SX1278_hal_task_self();
+    SX1278_hal_exit_critical();
+
+    while (!done)
     {
-        flags = read_single_access(REG_IRQ_FLAGS);
-        if ((flags & RX_DONE_MASK) != 0)
+        uint32_t received = SX1278_hal_task_wait(1, left);
+        uint32_t elapsed = (SX1278_hal_time_us() - start) / 1000;
+        uint8_t expired = timeout_ms != SX1278_WAIT_FOREVER && elapsed >= timeout_ms;
+        SX1278_hal_enter_critical();
+        done = op->done;
+        if (!done && expired)
         {
-            required_crc = hmode == 0 ? (read_single_access(REG_HOP_CHANNEL) & CRC_ON_PAYLOAD_MASK) : (read_single_access(REG_MODEM_CONFIG2) & RX_PAYLOAD_CRC_ON_MASK);
-            valid_crc = (flags & PAYLOAD_CRC_ERROR_MASK) & required_crc;
-            if ((flags & VALID_HEADER_MASK) != 0 && valid_crc == 0)
-            {
-                pfifo = read_single_access(REG_FIFO_RX_CURRENT_ADDR);
-                dev->fifo.size = hmode == 0 ? read_single_access(REG_RX_NB_BYTES) : read_single_access(REG_PAYLOAD_LENGTH);
-                write_single_access(REG_FIFO_ADDR_PTR, pfifo);
-                for (uint8_t i = 0; i < dev->fifo.size; i++)
-                {
-                    dev->fifo.buffer[i] = read_single_access(REG_FIFO);
-                }
-                if (rxmode == RxContinuous)
-                {
-                    write_single_access(REG_FIFO_ADDR_PTR, BASE_FIFO_ADDR);
-                }
-
-                uint8_t rssi = read_single_access(REG_PKT_RSSI_VALUE);
-                if (dev->settings.channel_freq > MID_RANGE_FREQ_THRESHOLD)
-                {
-                    dev->pkt_status.rssi = RSSI_OFFSET_HF + rssi + (rssi >> 4);
-                }
-                else
-                {
-                    dev->pkt_status.rssi = RSSI_OFFSET_LF + rssi + (rssi >> 4);
-                }
-                dev->pkt_status.snr = (int8_t)read_single_access(REG_PKT_SNR_VALUE) / 4;
-            }
-
-            // debug();
-            write_single_access(REG_IRQ_FLAGS, flags & (RX_DONE_MASK ^ 1));
-            write_single_access(REG_IRQ_FLAGS, flags & (VALID_HEADER_MASK ^ 1));
-            write_single_access(REG_IRQ_FLAGS, flags & (PAYLOAD_CRC_ERROR_MASK ^ 1));
-            xTaskNotifyGive(dev->rx_done_handle);
-            if (rxmode == RxSingle)
-            {
-                ESP_LOGI(TAG, "Rx done");
-                vTaskDelete(rx_done_handle);
-            }
+            op->waiter = NULL;
         }
-        else if ((flags & RX_TIMEOUT_MASK) != 0)
+        SX1278_hal_exit_critical();
+        if (done && received == 0)
         {
-            // ESP_LOGI(TAG, "Rx timeout");
-            dev->fifo.size = 0;
-            write_single_access(REG_IRQ_FLAGS, flags & (RX_TIMEOUT_MASK ^ 1));
-            xTaskNotifyGive(dev->rx_done_handle);
-            vTaskDelete(rx_done_handle);
+            // Completed right as the wait ran out, take the notification so it cannot end a later wait
+            SX1278_hal_task_wait(1, SX1278_WAIT_FOREVER);
         }
-        else
+        else if (expired)
+        {
+            return done ? op->status : OpPending;
+        }
+        else if (timeout_ms != SX1278_WAIT_FOREVER)
         {
-            // ESP_LOGI(TAG, "Delay");
-            vTaskDelay(100 / portTICK_PERIOD_MS);
+            left = timeout_ms - elapsed;
         }
     }
+    return op->status;
+}
+
+uint8_t SX1278_transmit_async(SX1278* dev, const uint8_t* data, uint8_t len, SX1278Op* op, uint32_t wait_ms)
+{
+    TxRequest request = { .data = data, .size = len, .op = op };
+    // The receiver has no header to learn another length from
+    if (dev->settings.modem_config1.bits.implicit_header_on && len != dev->expected_size)
+    {
+        ESP_LOGE(TAG, "Implicit header frames are %u bytes, not %u", dev->expected_size, len);
+        return 0;
+    }
+    op_arm(op);
+    if (!SX1278_hal_queue_send(dev->tx_queue, &request, wait_ms))
+    {
+        dev->stats.tx_queue_full++;
+        return 0;
+    }
+    Command cmd = { .type = CommandTxQueued };
+    SX1278_hal_queue_send(dev->cmd_queue, &cmd, SX1278_WAIT_FOREVER);
+    return 1;
+}
+
+uint8_t SX1278_transmit(SX1278* dev, const uint8_t* data, uint8_t len, uint32_t wait_ms)
+{
+    return SX1278_transmit_async(dev, data, len, NULL, wait_ms);
+}
+
+uint8_t SX1278_enqueue_tx(SX1278* dev, const uint8_t* data, uint8_t len, uint32_t wait_ms)
+{
+    uint8_t* buffer = SX1278_tx_lease(dev);
+    if (buffer == NULL)
+    {
+        return 0;
+    }
+    memcpy(buffer, data, len);
+    if (!SX1278_transmit(dev, buffer, len, wait_ms))
+    {
+        release_tx_buffer(buffer);
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t SX1278_tx_pending(SX1278* dev)
+{
+    return SX1278_hal_queue_count(dev->tx_queue);
 }
 
 void SX1278_start_rx(SX1278* dev, OperationMode rx_mode, HeaderMode header_mode)
 {
-    write_single_access(REG_OPMODE, STANDBY_MODE_DEFAULT);
-    write_single_access(REG_FIFO_RX_BASE_ADDR, BASE_FIFO_ADDR);
-    write_single_access(REG_FIFO_ADDR_PTR, BASE_FIFO_ADDR);
-    if (header_mode == ImplicitHeaderMode)
+    Command cmd = { .type = CommandRx, .mode = rx_mode, .header_mode = header_mode };
+    SX1278_hal_queue_send(dev->cmd_queue, &cmd, SX1278_WAIT_FOREVER);
+}
+
+void SX1278_receive_into(SX1278* dev, uint8_t* buffer, HeaderMode header_mode)
+{
+    SX1278_receive_async(dev, RxSingle, header_mode, buffer, NULL);
+}
+
+void SX1278_receive_async(SX1278* dev, OperationMode rx_mode, HeaderMode header_mode, uint8_t* buffer, SX1278Op* op)
+{
+    // In RxContinuous the operation completes with the first frame and the radio keeps listening
+    Command cmd = { .type = CommandRx, .mode = rx_mode, .header_mode = header_mode, .buffer = buffer, .job = op };
+    op_arm(op);
+    SX1278_hal_queue_send(dev->cmd_queue, &cmd, SX1278_WAIT_FOREVER);
+}
+
+uint8_t SX1278_stage_reply(SX1278* dev, const uint8_t* data, uint8_t len, SX1278Op* op)
+{
+    if (len > MAX_FIFO_BUFFER / 2)
     {
-        ESP_ERROR_CHECK_WITHOUT_ABORT(dev->fifo.size == 0);
-        write_single_access(REG_PAYLOAD_LENGTH, dev->fifo.size);
+        ESP_LOGE(TAG, "Reply too long to stage: %u", len);
+        return 0;
     }
-    switch (rx_mode)
+    ReplyJob job = { .data = data, .size = len, .op = op };
+    op_arm(op);
+    // The job is on this stack, the worker is done with it once this returns
+    call_on_worker(dev, handle_stage_reply, &job);
+    return 1;
+}
+
+void SX1278_start_cad(SX1278* dev)
+{
+    Command cmd = { .type = CommandCad };
+    SX1278_hal_queue_send(dev->cmd_queue, &cmd, SX1278_WAIT_FOREVER);
+}
+
+void SX1278_set_lbt(SX1278* dev, const SX1278Lbt* lbt)
+{
+    memcpy(&dev->lbt, lbt, sizeof(SX1278Lbt));
+}
+
+uint8_t SX1278_set_rx_streaming(SX1278* dev, uint8_t enabled)
+{
+    if (enabled && dev->config.dio_pins[3] == SX1278_PIN_UNUSED)
     {
-    case RxContinuous: write_single_access(REG_OPMODE, LORA_RX_CONTINUOUS_MODE); break;
-    case RxSingle: write_single_access(REG_OPMODE, LORA_RX_SINGLE_MODE); break;
-    default: ESP_ERROR_CHECK(1); break;
+        ESP_LOGE(TAG, "RX streaming needs ValidHeader on DIO3");
+        return 0;
     }
-    xTaskCreate(SX1278_wait_for_rx_done, "rx_done", 1024, (void*)dev, tskIDLE_PRIORITY, &rx_done_handle);
+    // Takes effect with the next RX start
+    dev->rx_streaming = enabled;
+    return 1;
 }
 
-void SX1278_switch_mode(SX1278* dev, OperationMode mode)
+static void apply_hop_table(SX1278* dev, void* arg)
 {
-    if ((read_single_access(REG_OPMODE) & OPERATION_MODE_MASK) == RxContinuous)
+    HopTableJob* job = arg;
+    // A zero period or an empty table turns hopping off and returns to the configured channel
+    if (job->count == 0 || job->period == 0)
     {
-        xTaskNotifyGive(dev->rx_done_handle);
-        vTaskDelete(rx_done_handle);
+        dev->hop_count = 0;
+        write_single_access(dev, REG_HOP_PERIOD, 0);
+        set_frf(dev, dev->settings.channel_freq);
+        return;
     }
-    write_single_access(REG_OPMODE, LORA_MODE | mode);
+    memcpy(dev->hop_table, job->frf, job->count * sizeof(uint32_t));
+    dev->hop_count = job->count;
+    write_single_access(dev, REG_HOP_PERIOD, job->period);
 }
 
-SX1278* SX1278_create()
+uint8_t SX1278_set_hop_table(SX1278* dev, const uint32_t* frf, uint8_t count, uint8_t period)
 {
-    SX1278_reset();
+    if (count > SX1278_MAX_HOP_CHANNELS)
+    {
+        ESP_LOGE(TAG, "Hop table too long: %u", count);
+        return 0;
+    }
+    // hop() runs on the worker, the table must not change under it
+    HopTableJob job = { .frf = frf, .count = count, .period = period };
+    call_on_worker(dev, apply_hop_table, &job);
+    return 1;
+}
+
+void SX1278_start_sniff(SX1278* dev, HeaderMode header_mode)
+{
+    Command cmd = { .type = CommandSniff, .header_mode = header_mode };
+    SX1278_hal_queue_send(dev->cmd_queue, &cmd, SX1278_WAIT_FOREVER);
+}
+
+uint32_t SX1278_get_sniff_interval_us(SX1278* dev)
+{
+    return sniff_interval_us(dev);
+}
+
+void SX1278_switch_mode(SX1278* dev, OperationMode mode)
+{
+    Command cmd = { .type = CommandSwitchMode, .mode = mode };
+    SX1278_hal_queue_send(dev->cmd_queue, &cmd, SX1278_WAIT_FOREVER);
+}
 
-    SX1278* device = malloc(sizeof(SX1278));
-    device->fifo.size = 0;
-    device->fifo.expected_size = 0;
+SX1278* SX1278_create(const SX1278Config* config)
+{
+    SX1278* device = NULL;
+    SX1278_hal_enter_critical();
+    for (uint8_t i = 0; i < SX1278_MAX_DEVICES; i++)
+    {
+        if (!devices_used[i])
+        {
+            devices_used[i] = 1;
+            device = &devices[i];
+            break;
+        }
+    }
+    SX1278_hal_exit_critical();
+    if (device == NULL)
+    {
+        ESP_LOGE(TAG, "No free device slot");
+        return NULL;
+    }
+    memcpy(&device->config, config, sizeof(SX1278Config));
+    device->expected_size = 0;
+    device->shadow_mismatches = 0;
+    memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+    device->rx_buffer = NULL;
+    device->tx_inflight = NULL;
+    device->tx_op = NULL;
+    device->rx_op = NULL;
+    device->reply = NULL;
+    device->reply_op = NULL;
+    device->replying = 0;
+    device->reply_loaded = 0;
+    device->rx_streaming = 0;
+    device->stream_dst = NULL;
+    device->stream_packet = NULL;
     device->rx_done_handle = NULL;
     device->tx_done_handle = NULL;
+    device->cad_done_handle = NULL;
+    device->cad_detected = 0;
+    memset(&device->lbt, 0, sizeof(SX1278Lbt));
+    device->lbt_cad = 0;
+    device->lbt_backoff = 0;
+    device->sniffing = 0;
+    device->sniff_cad = 0;
+    device->hop_count = 0;
+    device->mode = Sleep;
+    device->header_mode = ExplicitHeaderMode;
+    device->rx_header_mode = ExplicitHeaderMode;
+    device->resume_rx = 0;
+    device->rx_ring.head = 0;
+    device->rx_ring.tail = 0;
+    device->rx_ring.overflows = 0;
+    memset(&device->spi_stats, 0, sizeof(SpiStats));
+    memset(&device->stats, 0, sizeof(SX1278Stats));
+#ifdef CONFIG_SX1278_TRACE
+    device->trace_head = 0;
+#endif
 
-    spi_config_t spi_config = {0};
-    spi_config.interface.val = SPI_DEFAULT_INTERFACE;
-    spi_config.intr_enable.val = SPI_MASTER_DEFAULT_INTR_ENABLE;
-    spi_config.mode = SPI_MASTER_MODE;
-    spi_config.clk_div = SPI_10MHz_DIV;
-    spi_init(HSPI_HOST, &spi_config);
+    uint32_t start = SX1278_hal_time_us();
+    device->mode_since = start;
+    SX1278_hal_spi_init(config->spi_host, config->cs_pin);
+    if (!(config->warm_start && warm_start(device)) && !SX1278_reset(device))
+    {
+        ESP_LOGE(TAG, "Chip not responding");
+        SX1278_hal_spi_deinit(config->spi_host, config->cs_pin);
+        devices_used[device - devices] = 0;
+        return NULL;
+    }
+    device->ready_us = SX1278_hal_time_us() - start;
 
-    vTaskDelay(200 / portTICK_PERIOD_MS);
+    device->cmd_queue = SX1278_hal_queue_create(COMMAND_QUEUE_LENGTH, sizeof(Command));
+    device->tx_queue = SX1278_hal_queue_create(SX1278_TX_QUEUE_LENGTH, sizeof(TxRequest));
+    device->sync_lock = SX1278_hal_semaphore_create();
+    device->sync_done = SX1278_hal_semaphore_create();
+    SX1278_hal_semaphore_give(device->sync_lock);
+    device->worker_task = SX1278_hal_task_create(SX1278_worker, "sx1278", WORKER_STACK_SIZE, device, WORKER_PRIORITY);
+
+    for (uint8_t i = 0; i < SX1278_DIO_COUNT; i++)
+    {
+        if (config->dio_pins[i] != SX1278_PIN_UNUSED)
+        {
+            SX1278_hal_gpio_attach_isr(config->dio_pins[i], on_dio, device);
+        }
+    }
 
     return device;
 }
 
 void SX1278_destroy(SX1278* device)
 {
-    free(device);
-    spi_deinit(HSPI_HOST);
-    
-    vTaskDelay(200 / portTICK_PERIOD_MS);
+    for (uint8_t i = 0; i < SX1278_DIO_COUNT; i++)
+    {
+        if (device->config.dio_pins[i] != SX1278_PIN_UNUSED)
+        {
+            SX1278_hal_gpio_detach_isr(device->config.dio_pins[i]);
+        }
+    }
+
+    // The worker is gone once this returns, everything below is only touched here
+    Command cmd = { .type = CommandStop };
+    run_sync(device, &cmd);
+
+    TxRequest request;
+    release_tx_buffer(device->tx_inflight);
+    complete_op(device->tx_op, OpAborted);
+    complete_op(device->reply_op, OpAborted);
+    complete_rx(device, OpAborted);
+    stream_reset(device);
+    while (SX1278_hal_queue_receive(device->tx_queue, &request, 0))
+    {
+        release_tx_buffer(request.data);
+        complete_op(request.op, OpAborted);
+    }
+    SX1278_hal_queue_delete(device->cmd_queue);
+    SX1278_hal_queue_delete(device->tx_queue);
+    SX1278_hal_semaphore_delete(device->sync_lock);
+    SX1278_hal_semaphore_delete(device->sync_done);
+    SX1278_hal_spi_deinit(device->config.spi_host, device->config.cs_pin);
+    while (SX1278_rx_peek(device) != NULL)
+    {
+        SX1278_rx_release(device);
+    }
+    devices_used[device - devices] = 0;
 }
 
 
-void SX1278_initialize(SX1278* device, SX1278Settings* settings)
+static void update_toa(SX1278* device)
+{
+    SX1278Settings* settings = &device->settings;
+    SX1278_toa_prepare(&device->toa,
+        settings->modem_config2.bits.spreading_factor,
+        settings->modem_config1.bits.bandwidth,
+        settings->modem_config1.bits.coding_rate,
+        settings->preamble_len,
+        settings->modem_config1.bits.implicit_header_on,
+        settings->modem_config2.bits.rx_payload_crc_on,
+        device->low_data_rate);
+}
+
+static uint32_t reconfigure(SX1278* device, const SX1278Settings* settings)
 {
-    write_single_access(REG_OPMODE, SLEEP_MODE_DEFAULT);
-    write_single_access(REG_OPMODE, LORA_MODE);
+    // Ascending register order so that adjacent entries merge into one burst
+    const uint8_t regs[] = {
+        REG_FR_MSB, REG_FR_MID, REG_FR_LSB, REG_PA_CONFIG,
+        REG_MODEM_CONFIG1, REG_MODEM_CONFIG2,
+        REG_PREAMBLE_MSB, REG_PREAMBLE_LSB,
+        REG_INVERT_IQ, REG_SYNC_WORD,
+    };
+    const uint8_t values[] = {
+        (settings->channel_freq >> 16) & 0xff,
+        (settings->channel_freq >> 8) & 0xff,
+        settings->channel_freq & 0xff,
+        settings->pa_config.val,
+        settings->modem_config1.val,
+        settings->modem_config2.val,
+        settings->preamble_len >> 8,
+        settings->preamble_len & 0xff,
+        settings->invert_iq.val,
+        settings->sync_word,
+    };
+    uint32_t bytes = device->spi_stats.bytes;
+    uint8_t mode = 0;
+    uint8_t restore = 0;
+
+    for (uint8_t i = 0; i < sizeof(regs); i++)
+    {
+        if (shadow_hit(device, regs[i]) && device->shadow[regs[i]] == values[i])
+        {
+            continue;
+        }
+
+        uint8_t run = 1;
+        while (i + run < sizeof(regs) && regs[i + run] == regs[i] + run
+            && !(shadow_hit(device, regs[i + run]) && device->shadow[regs[i + run]] == values[i + run]))
+        {
+            run++;
+        }
 
-    SX1278_set_frequency(device, settings->channel_freq);
-    write_single_access(REG_PA_CONFIG, settings->pa_config.val);
-    write_single_access(REG_MODEM_CONFIG1, settings->modem_config1.val);
-    write_single_access(REG_MODEM_CONFIG2, settings->modem_config2.val);
-    write_single_access(REG_SYNC_WORD, settings->sync_word);
-    write_single_access(REG_INVERT_IQ, settings->invert_iq.val);
+        if (!restore)
+        {
+            mode = read_single_access(device, REG_OPMODE);
+            if (mode != SLEEP_MODE_DEFAULT && mode != STANDBY_MODE_DEFAULT)
+            {
+                write_single_access(device, REG_OPMODE, STANDBY_MODE_DEFAULT);
+            }
+            restore = 1;
+        }
+        write_burst_access(device, regs[i], &values[i], run);
+        i += run - 1;
+    }
+
+    if (restore && mode != SLEEP_MODE_DEFAULT && mode != STANDBY_MODE_DEFAULT)
+    {
+        write_single_access(device, REG_OPMODE, mode);
+    }
 
     memcpy(&device->settings, settings, sizeof(SX1278Settings));
+    device->low_data_rate = (read_single_access(device, REG_MODEM_CONFIG3) & LOW_DATA_RATE_OPTIMIZE_MASK) != 0;
+    update_toa(device);
+
+    return device->spi_stats.bytes - bytes;
+}
+
+static void apply_settings(SX1278* device, void* arg)
+{
+    ConfigJob* job = arg;
+    job->bytes = reconfigure(device, job->settings);
+}
+
+uint32_t SX1278_reconfigure(SX1278* device, SX1278Settings* settings)
+{
+    ConfigJob job = { .settings = settings };
+    call_on_worker(device, apply_settings, &job);
+    return job.bytes;
+}
 
-    vTaskDelay(200 / portTICK_PERIOD_MS);
+static void apply_initialize(SX1278* device, void* arg)
+{
+    // The chip only takes the LoRa bit in Sleep, so from FSK Standby it needs two writes
+    if (!(spi_read(device, REG_OPMODE) & LORA_MODE))
+    {
+        write_single_access(device, REG_OPMODE, FSK_SLEEP_MODE);
+        write_single_access(device, REG_OPMODE, LORA_MODE | Sleep);
+        set_mode(device, Sleep);
+    }
+    // Read back, the shadow holds what was written rather than what the chip took
+    uint8_t mode = spi_read(device, REG_OPMODE);
+    shadow_store(device, REG_OPMODE, mode);
+    if (!(mode & LORA_MODE))
+    {
+        ESP_LOGE(TAG, "LoRa mode not selected, OPMODE %02x", mode);
+    }
+
+    uint32_t bytes = reconfigure(device, arg);
+    ESP_LOGD(TAG, "Initialized with %u SPI bytes", (unsigned) bytes);
     // debug();
 }
 
-void SX1278_set_txpower(SX1278* device, TxPower txpower)
+void SX1278_initialize(SX1278* device, SX1278Settings* settings)
 {
-    uint8_t mode = read_single_access(REG_OPMODE);
-    write_single_access(REG_OPMODE, STANDBY_MODE_DEFAULT);
+    call_on_worker(device, apply_initialize, settings);
+}
 
-    uint8_t pa_config = (DEFAULT_PA_CONFIG & 0b1111) | txpower;
-    write_single_access(REG_PA_CONFIG, pa_config);
+static void apply_implicit_header(SX1278* device, void* arg)
+{
+    ImplicitJob* job = arg;
+    // Both ends need the same length and CRC setting, a zero length goes back to explicit headers
+    SX1278Settings settings = device->settings;
+    settings.modem_config1.bits.implicit_header_on = job->payload_len != 0;
+    settings.modem_config2.bits.rx_payload_crc_on = job->crc_on != 0;
+    device->expected_size = job->payload_len;
+    reconfigure(device, &settings);
+    if (job->payload_len != 0)
+    {
+        write_changed(device, REG_PAYLOAD_LENGTH, job->payload_len);
+    }
+}
 
-    write_single_access(REG_OPMODE, mode);
+void SX1278_set_implicit_header(SX1278* device, uint8_t payload_len, uint8_t crc_on)
+{
+    ImplicitJob job = { .payload_len = payload_len, .crc_on = crc_on };
+    call_on_worker(device, apply_implicit_header, &job);
 }
 
-void SX1278_set_frequency(SX1278* device, ChannelFrequency freq)
+static void apply_txpower(SX1278* device, void* arg)
+{
+    uint8_t mode = read_single_access(device, REG_OPMODE);
+    write_single_access(device, REG_OPMODE, STANDBY_MODE_DEFAULT);
+
+    uint8_t pa_config = (DEFAULT_PA_CONFIG & 0b1111) | *(TxPower*)arg;
+    write_single_access(device, REG_PA_CONFIG, pa_config);
+
+    write_single_access(device, REG_OPMODE, mode);
+}
+
+void SX1278_set_txpower(SX1278* device, TxPower txpower)
+{
+    call_on_worker(device, apply_txpower, &txpower);
+}
+
+static void apply_frequency(SX1278* device, void* arg)
 {
-    uint8_t mode = read_single_access(REG_OPMODE);
-    write_single_access(REG_OPMODE, STANDBY_MODE_DEFAULT);
+    ChannelFrequency freq = *(ChannelFrequency*)arg;
+    // The synthesizer takes the new frequency once FR_LSB, the last byte of the burst, is written
+    set_frf(device, freq);
+    device->settings.channel_freq = freq;
+}
 
-    write_single_access(REG_FR_LSB, freq & 0xff);
-    freq = freq >> 8;
-    write_single_access(REG_FR_MID, freq & 0xff);
-    freq = freq >> 8;
-    write_single_access(REG_FR_MSB, freq & 0xff);
+void SX1278_set_frequency(SX1278* device, ChannelFrequency freq)
+{
+    call_on_worker(device, apply_frequency, &freq);
+}
 
-    write_single_access(REG_OPMODE, mode);
+uint32_t SX1278_hz_to_frf(uint32_t hz)
+{
+    // Split so that the intermediate products stay within 32 bits
+    return (hz / FRF_HZ_DIVISOR) * FRF_HZ_MULTIPLIER
+        + ((hz % FRF_HZ_DIVISOR) * FRF_HZ_MULTIPLIER + FRF_HZ_DIVISOR / 2) / FRF_HZ_DIVISOR;
 }
 
-double SX1278_get_toa(SX1278* device)
+uint32_t SX1278_frf_to_hz(uint32_t frf)
 {
-    double PL = device->fifo.size;
-    double SF = device->settings.modem_config2.bits.spreading_factor;
-    double IH = device->settings.modem_config1.bits.implicit_header_on;
-    double DE = (read_single_access(REG_MODEM_CONFIG3) >> 4) & 1;
-    double CR =  device->settings.modem_config1.bits.coding_rate;
-    uint8_t bw = device->settings.modem_config1.bits.bandwidth;
-    double BW = bw == Bw7_8kHz ? 7.8 : 
-                bw == Bw10_4kHz ? 10.4 :
-                bw == Bw15_6kHz ? 15.6 :
-                bw == Bw20_8kHz ? 20.8 :
-                bw == Bw31_25kHz ? 31.2 :
-                bw == Bw41_7kHz ? 41.7 :
-                bw == Bw62_5kHz ? 62.5 :
-                bw == Bw125kHz ? 125 :
-                bw == Bw250kHz ? 250 :
-                500;
+    return (frf / FRF_HZ_MULTIPLIER) * FRF_HZ_DIVISOR
+        + ((frf % FRF_HZ_MULTIPLIER) * FRF_HZ_DIVISOR + FRF_HZ_MULTIPLIER / 2) / FRF_HZ_MULTIPLIER;
+}
 
-    double T_sym = pow(2, SF) / BW;
+void SX1278_set_frequency_hz(SX1278* device, uint32_t hz)
+{
+    SX1278_set_frequency(device, SX1278_hz_to_frf(hz));
+}
 
-    double T_preamble = (device->settings.preamble_len + 4.25) * T_sym;
+uint8_t SX1278_channel_plan_init(SX1278ChannelPlan* plan, uint32_t first_hz, uint32_t spacing_hz, uint8_t count)
+{
+    if (count > SX1278_MAX_PLAN_CHANNELS)
+    {
+        ESP_LOGE(TAG, "Channel plan too long: %u", count);
+        return 0;
+    }
+    plan->count = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        plan->frf[i] = SX1278_hz_to_frf(first_hz + i * spacing_hz);
+    }
+    return 1;
+}
 
-    double temp_a = 8 * PL - 4 * SF + 28 + 16 * CR - 20 * IH;
-    double temp_b = 4 * (SF - 2 * DE);
-    double temp_c = ceil(temp_a / temp_b) * (CR + 4);
-    double temp = temp_c > 0 ? temp_c : 0;
-    double payload = 8 + temp;
+uint8_t SX1278_set_channel(SX1278* device, const SX1278ChannelPlan* plan, uint8_t index)
+{
+    if (index >= plan->count)
+    {
+        return 0;
+    }
+    SX1278_set_frequency(device, plan->frf[index]);
+    return 1;
+}
 
-    double T_payload = payload * T_sym;
+uint8_t SX1278_scan_channels(SX1278* dev, const SX1278ChannelPlan* plan, int16_t* rssi, uint32_t dwell_us)
+{
+    ScanJob job = { .plan = plan, .rssi = rssi, .dwell_us = dwell_us, .quietest = 0 };
+    // The worker runs the scan, it cannot wait for itself
+    if (SX1278_hal_task_self() == dev->worker_task)
+    {
+        ESP_LOGE(TAG, "Channel scan from the worker task");
+        return 0;
+    }
+    Command cmd = { .type = CommandScan, .job = &job };
+    run_sync(dev, &cmd);
+    return job.quietest;
+}
 
-    return T_preamble + T_payload;
-}
\ No newline at end of file
+uint32_t SX1278_get_toa_us(SX1278* device, uint8_t payload_len)
+{
+    return SX1278_toa_us(&device->toa, payload_len);
+}
@@ -0,0 +1,223 @@
+#include "SX1278Aggregator.h"
+#include "string.h"
+#include "esp_system.h"
+#include "esp_log.h"
+
+#define AGGREGATOR_STACK_SIZE       2048
+#define AGGREGATOR_PRIORITY         4
+
+static const char* TAG = "SX1278Aggregator";
+
+static SX1278Aggregator aggregators[SX1278_MAX_DEVICES];
+static uint8_t aggregators_used[SX1278_MAX_DEVICES] = {0};
+
+
+static uint8_t is_implicit(SX1278Aggregator* aggregator)
+{
+    return aggregator->dev->settings.modem_config1.bits.implicit_header_on;
+}
+
+static void flush(SX1278Aggregator* aggregator, uint32_t* reason)
+{
+    if (aggregator->count == 0)
+    {
+        return;
+    }
+    // Implicit header frames have a fixed length, a zero length byte ends the records
+    uint8_t size = aggregator->size;
+    if (is_implicit(aggregator))
+    {
+        memset(&aggregator->frame[size], 0, aggregator->max_frame - size);
+        size = aggregator->max_frame;
+    }
+
+    uint32_t airtime = SX1278_get_toa_us(aggregator->dev, size);
+    SX1278AggregatorStats* stats = &aggregator->stats;
+    if (SX1278_enqueue_tx(aggregator->dev, aggregator->frame, size, SX1278_WAIT_FOREVER))
+    {
+        stats->frames++;
+        stats->airtime_us += airtime;
+        if (aggregator->unaggregated_us > airtime)
+        {
+            stats->airtime_saved_us += aggregator->unaggregated_us - airtime;
+        }
+        if (reason != NULL)
+        {
+            (*reason)++;
+        }
+    }
+    else
+    {
+        ESP_LOGW(TAG, "No TX buffer, %u messages dropped", aggregator->count);
+        stats->dropped += aggregator->count;
+    }
+    aggregator->size = 0;
+    aggregator->count = 0;
+    aggregator->unaggregated_us = 0;
+}
+
+static void append(SX1278Aggregator* aggregator, const AggregatorMessage* message)
+{
+    if (aggregator->size + 1 + message->size > aggregator->max_frame)
+    {
+        flush(aggregator, &aggregator->stats.flush_full);
+    }
+    aggregator->frame[aggregator->size++] = message->size;
+    memcpy(&aggregator->frame[aggregator->size], message->data, message->size);
+    aggregator->size += message->size;
+    aggregator->stats.messages++;
+
+    // What the message would have cost in a frame of its own
+    aggregator->unaggregated_us += SX1278_get_toa_us(aggregator->dev, is_implicit(aggregator) ? aggregator->max_frame : message->size);
+    if (aggregator->count++ == 0 || (int32_t)(message->deadline_us - aggregator->deadline_us) < 0)
+    {
+        aggregator->deadline_us = message->deadline_us;
+    }
+    if (aggregator->max_frame - aggregator->size < 2)
+    {
+        flush(aggregator, &aggregator->stats.flush_full);
+    }
+}
+
+static void stop(SX1278Aggregator* aggregator)
+{
+    // Messages sent before destroy are ahead of the stop in the queue, any that raced it still go out
+    AggregatorMessage message;
+    while (SX1278_hal_queue_receive(aggregator->messages, &message, 0))
+    {
+        if (message.command == AggregatorData)
+        {
+            append(aggregator, &message);
+        }
+    }
+    flush(aggregator, NULL);
+    SX1278_hal_semaphore_give(aggregator->stopped);
+    SX1278_hal_task_exit();
+}
+
+static void aggregator_task(void* p)
+{
+    SX1278Aggregator* aggregator = p;
+    AggregatorMessage message;
+    while (1)
+    {
+        uint32_t wait = SX1278_WAIT_FOREVER;
+        if (aggregator->count > 0)
+        {
+            // Checked before the queue so that a steady stream of messages cannot hold a frame back
+            int32_t left = (int32_t)(aggregator->deadline_us - SX1278_hal_time_us());
+            if (left <= 0)
+            {
+                flush(aggregator, &aggregator->stats.flush_deadline);
+                continue;
+            }
+            wait = left / 1000 + 1;
+        }
+        if (!SX1278_hal_queue_receive(aggregator->messages, &message, wait))
+        {
+            continue;
+        }
+        switch (message.command)
+        {
+        case AggregatorData: append(aggregator, &message); break;
+        case AggregatorFlush: flush(aggregator, NULL); break;
+        case AggregatorStop: stop(aggregator); break;
+        }
+    }
+}
+
+SX1278Aggregator* SX1278_aggregator_create(SX1278* dev, uint8_t max_frame)
+{
+    SX1278Aggregator* aggregator = NULL;
+    // Implicit header frames are all as long as the profile says
+    if (dev->settings.modem_config1.bits.implicit_header_on)
+    {
+        max_frame = dev->expected_size;
+    }
+    if (max_frame < 2)
+    {
+        ESP_LOGE(TAG, "Frame too short to aggregate: %u", max_frame);
+        return NULL;
+    }
+    SX1278_hal_enter_critical();
+    for (uint8_t i = 0; i < SX1278_MAX_DEVICES; i++)
+    {
+        if (!aggregators_used[i])
+        {
+            aggregators_used[i] = 1;
+            aggregator = &aggregators[i];
+            break;
+        }
+    }
+    SX1278_hal_exit_critical();
+    if (aggregator == NULL)
+    {
+        ESP_LOGE(TAG, "No free aggregator slot");
+        return NULL;
+    }
+
+    memset(aggregator, 0, sizeof(SX1278Aggregator));
+    aggregator->dev = dev;
+    aggregator->max_frame = max_frame;
+    aggregator->messages = SX1278_hal_queue_create(SX1278_AGGREGATOR_QUEUE_LENGTH, sizeof(AggregatorMessage));
+    aggregator->stopped = SX1278_hal_semaphore_create();
+    aggregator->task = SX1278_hal_task_create(aggregator_task, "sx1278agg", AGGREGATOR_STACK_SIZE, aggregator, AGGREGATOR_PRIORITY);
+    return aggregator;
+}
+
+void SX1278_aggregator_destroy(SX1278Aggregator* aggregator)
+{
+    // The task sends whatever is still waiting before it exits
+    AggregatorMessage message = { .command = AggregatorStop };
+    SX1278_hal_queue_send(aggregator->messages, &message, SX1278_WAIT_FOREVER);
+    SX1278_hal_semaphore_take(aggregator->stopped, SX1278_WAIT_FOREVER);
+
+    SX1278_hal_queue_delete(aggregator->messages);
+    SX1278_hal_semaphore_delete(aggregator->stopped);
+    aggregators_used[aggregator - aggregators] = 0;
+}
+
+uint8_t SX1278_aggregator_send(SX1278Aggregator* aggregator, const uint8_t* data, uint8_t len, uint32_t deadline_ms, uint32_t wait_ms)
+{
+    if (len == 0 || len > SX1278_AGGREGATOR_MAX_MESSAGE || len + 1 > aggregator->max_frame)
+    {
+        ESP_LOGE(TAG, "Unsupported message length: %u", len);
+        return 0;
+    }
+    if (deadline_ms > SX1278_AGGREGATOR_MAX_DEADLINE_MS)
+    {
+        ESP_LOGE(TAG, "Deadline too far ahead: %u ms", deadline_ms);
+        return 0;
+    }
+    AggregatorMessage message = {
+        .command = AggregatorData,
+        .size = len,
+        .deadline_us = SX1278_hal_time_us() + deadline_ms * 1000,
+    };
+    memcpy(message.data, data, len);
+    return SX1278_hal_queue_send(aggregator->messages, &message, wait_ms);
+}
+
+void SX1278_aggregator_flush(SX1278Aggregator* aggregator)
+{
+    AggregatorMessage message = { .command = AggregatorFlush };
+    SX1278_hal_queue_send(aggregator->messages, &message, SX1278_WAIT_FOREVER);
+}
+
+uint8_t SX1278_aggregator_next(const uint8_t* frame, uint8_t size, uint8_t* offset, const uint8_t** data, uint8_t* len)
+{
+    // Records are a length byte followed by the message, padding or a short frame ends the walk
+    if (*offset >= size || frame[*offset] == 0 || *offset + 1 + frame[*offset] > size)
+    {
+        return 0;
+    }
+    *len = frame[*offset];
+    *data = &frame[*offset + 1];
+    *offset += 1 + *len;
+    return 1;
+}
+
+void SX1278_aggregator_get_stats(SX1278Aggregator* aggregator, SX1278AggregatorStats* stats)
+{
+    memcpy(stats, &aggregator->stats, sizeof(SX1278AggregatorStats));
+}
@@ -0,0 +1,228 @@
+#include "SX1278Gateway.h"
+#include "string.h"
+#include "esp_system.h"
+#include "esp_log.h"
+
+#define GATEWAY_STACK_SIZE          2048
+#define GATEWAY_PRIORITY            4
+#define GATEWAY_POLL_MS             100
+
+#define MEMORY_BARRIER()            __sync_synchronize()
+
+static const char* TAG = "SX1278Gateway";
+
+static SX1278Gateway gateway_instance;
+static uint8_t gateway_used = 0;
+
+
+static void tune(SX1278Gateway* gateway, GatewayRadio* radio, uint8_t target)
+{
+    SX1278Settings settings = gateway->base;
+    const SX1278ListenTarget* listen = &gateway->targets[target];
+    settings.channel_freq = listen->frf;
+    settings.modem_config1.bits.bandwidth = listen->bw;
+    settings.modem_config2.bits.spreading_factor = listen->sf;
+    // Runs on the radio's worker, only the registers that differ from the previous target go over SPI
+    SX1278_reconfigure(radio->dev, &settings);
+    radio->target = target;
+}
+
+static uint32_t rx_events(const SX1278Stats* stats)
+{
+    return stats->rx_packets + stats->rx_timeouts + stats->crc_errors + stats->header_errors;
+}
+
+static void start_cad(GatewayRadio* radio)
+{
+    SX1278Stats stats;
+    SX1278_get_stats(radio->dev, &stats);
+    radio->receiving = 0;
+    radio->cad_runs = stats.cad_runs;
+    radio->cad_busy = stats.cad_busy;
+    SX1278_start_cad(radio->dev);
+}
+
+static void drain(SX1278Gateway* gateway, uint8_t index)
+{
+    GatewayRadio* radio = &gateway->radios[index];
+    PacketBuffer* packet;
+    while ((packet = SX1278_rx_take(radio->dev)) != NULL)
+    {
+        SX1278Uplink uplink = {
+            .packet = packet,
+            .target = gateway->targets[radio->target],
+            .target_index = radio->target,
+            .radio_index = index,
+        };
+        // Counted first so that a consumer woken by the send already sees it
+        gateway->stats.received++;
+        gateway->stats.per_target[radio->target]++;
+        if (!SX1278_hal_queue_send(gateway->uplinks, &uplink, 0))
+        {
+            SX1278_pool_free(packet);
+            gateway->stats.received--;
+            gateway->stats.per_target[radio->target]--;
+            gateway->stats.dropped++;
+        }
+    }
+}
+
+static void rotate(SX1278Gateway* gateway, uint8_t index)
+{
+    GatewayRadio* radio = &gateway->radios[index];
+    SX1278Stats stats;
+    // Taken on the worker, so a frame counted here is already in the ring and the radio out of RxSingle
+    SX1278_get_stats(radio->dev, &stats);
+    if (radio->receiving)
+    {
+        if (rx_events(&stats) == radio->rx_events)
+        {
+            return;
+        }
+        // Tag the frame with this target before the radio is retuned
+        drain(gateway, index);
+        // Woken by a CAD but the frame never made it: timeout, CRC or header error
+        if (stats.rx_packets == radio->rx_packets)
+        {
+            gateway->stats.rx_missed++;
+        }
+    }
+    else
+    {
+        if (stats.cad_runs == radio->cad_runs)
+        {
+            return;
+        }
+        gateway->stats.cad_runs++;
+        // A preamble on this target: stay and receive it before moving on
+        if (stats.cad_busy != radio->cad_busy)
+        {
+            gateway->stats.cad_detected++;
+            radio->receiving = 1;
+            radio->rx_events = rx_events(&stats);
+            radio->rx_packets = stats.rx_packets;
+            SX1278_start_rx(radio->dev, RxSingle, ExplicitHeaderMode);
+            return;
+        }
+    }
+
+    uint8_t span = gateway->target_count - gateway->first_rotating;
+    uint8_t next = gateway->first_rotating + (radio->target - gateway->first_rotating + 1) % span;
+    tune(gateway, radio, next);
+    start_cad(radio);
+}
+
+static void gateway_task(void* p)
+{
+    SX1278Gateway* gateway = p;
+    while (gateway->running)
+    {
+        SX1278_hal_task_wait(1, GATEWAY_POLL_MS);
+        for (uint8_t i = 0; i < gateway->radio_count; i++)
+        {
+            drain(gateway, i);
+            if (i >= gateway->first_rotating && gateway->first_rotating < gateway->target_count)
+            {
+                rotate(gateway, i);
+            }
+        }
+    }
+    SX1278_hal_task_notify(gateway->stop_caller);
+    SX1278_hal_task_exit();
+}
+
+SX1278Gateway* SX1278_gateway_create(SX1278* const* radios, uint8_t radio_count,
+    const SX1278ListenTarget* targets, uint8_t target_count, const SX1278Settings* base)
+{
+    if (radio_count == 0 || radio_count > SX1278_GATEWAY_MAX_RADIOS
+        || target_count == 0 || target_count > SX1278_GATEWAY_MAX_TARGETS)
+    {
+        ESP_LOGE(TAG, "Unsupported layout: %u radios, %u targets", radio_count, target_count);
+        return NULL;
+    }
+    SX1278_hal_enter_critical();
+    uint8_t used = gateway_used;
+    gateway_used = 1;
+    SX1278_hal_exit_critical();
+    if (used)
+    {
+        ESP_LOGE(TAG, "Gateway already running");
+        return NULL;
+    }
+
+    SX1278Gateway* gateway = &gateway_instance;
+    memset(gateway, 0, sizeof(SX1278Gateway));
+    memcpy(gateway->targets, targets, target_count * sizeof(SX1278ListenTarget));
+    memcpy(&gateway->base, base, sizeof(SX1278Settings));
+    gateway->target_count = target_count;
+    // Dedicated radios for as many targets as possible, the last radio rotates over the rest
+    gateway->first_rotating = radio_count >= target_count ? target_count : radio_count - 1;
+    gateway->uplinks = SX1278_hal_queue_create(SX1278_GATEWAY_QUEUE_LENGTH, sizeof(SX1278Uplink));
+    gateway->running = 1;
+    gateway->task = SX1278_hal_task_create(gateway_task, "sx1278gw", GATEWAY_STACK_SIZE, gateway, GATEWAY_PRIORITY);
+
+    for (uint8_t i = 0; i < radio_count; i++)
+    {
+        GatewayRadio* radio = &gateway->radios[i];
+        radio->dev = radios[i];
+        radio->dev->rx_done_handle = gateway->task;
+        radio->dev->cad_done_handle = gateway->task;
+        if (i < gateway->first_rotating)
+        {
+            tune(gateway, radio, i);
+            SX1278_start_rx(radio->dev, RxContinuous, ExplicitHeaderMode);
+        }
+        else if (i == gateway->first_rotating && i < target_count)
+        {
+            tune(gateway, radio, i);
+            start_cad(radio);
+        }
+    }
+    MEMORY_BARRIER();
+    gateway->radio_count = radio_count;
+    return gateway;
+}
+
+void SX1278_gateway_destroy(SX1278Gateway* gateway)
+{
+    gateway->stop_caller = SX1278_hal_task_self();
+    gateway->running = 0;
+    SX1278_hal_task_notify(gateway->task);
+    SX1278_hal_task_wait(1, SX1278_WAIT_FOREVER);
+
+    for (uint8_t i = 0; i < gateway->radio_count; i++)
+    {
+        SX1278* dev = gateway->radios[i].dev;
+        SX1278_switch_mode(dev, Standby);
+        dev->rx_done_handle = NULL;
+        dev->cad_done_handle = NULL;
+    }
+    SX1278Uplink uplink;
+    while (SX1278_hal_queue_receive(gateway->uplinks, &uplink, 0))
+    {
+        SX1278_gateway_release(&uplink);
+    }
+    SX1278_hal_queue_delete(gateway->uplinks);
+    gateway_used = 0;
+}
+
+uint8_t SX1278_gateway_receive(SX1278Gateway* gateway, SX1278Uplink* uplink, uint32_t wait_ms)
+{
+    return SX1278_hal_queue_receive(gateway->uplinks, uplink, wait_ms);
+}
+
+void SX1278_gateway_release(SX1278Uplink* uplink)
+{
+    SX1278_pool_free(uplink->packet);
+    uplink->packet = NULL;
+}
+
+uint8_t SX1278_gateway_target_radio(SX1278Gateway* gateway, uint8_t target)
+{
+    return target < gateway->first_rotating ? target : SX1278_GATEWAY_ROTATING;
+}
+
+void SX1278_gateway_get_stats(SX1278Gateway* gateway, SX1278GatewayStats* stats)
+{
+    memcpy(stats, &gateway->stats, sizeof(SX1278GatewayStats));
+}
@@ -0,0 +1,262 @@
+#include "SX1278Hal.h"
+#include "string.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "driver/spi.h"
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "rom/ets_sys.h"
+
+#define SPI_HOST_COUNT              2
+
+typedef struct SpiHost_struct
+{
+    uint8_t users;
+    SemaphoreHandle_t lock;
+} SpiHost;
+
+static SpiHost spi_hosts[SPI_HOST_COUNT] = {0};
+static uint8_t isr_service_installed = 0;
+
+
+static TickType_t to_ticks(uint32_t ms)
+{
+    // Rounded up, a short wait must not turn into a zero tick poll
+    if (ms == SX1278_WAIT_FOREVER)
+    {
+        return portMAX_DELAY;
+    }
+    return ms / portTICK_PERIOD_MS + (ms % portTICK_PERIOD_MS != 0);
+}
+
+
+void SX1278_hal_spi_init(int host, int cs_pin)
+{
+    SpiHost* bus = &spi_hosts[host];
+    if (cs_pin >= 0)
+    {
+        SX1278_hal_gpio_output(cs_pin);
+        SX1278_hal_gpio_set_level(cs_pin, 1);
+    }
+    if (bus->users++ > 0)
+    {
+        return;
+    }
+
+    spi_config_t spi_config = {0};
+    spi_config.interface.val = SPI_DEFAULT_INTERFACE;
+    // A device with its own chip-select pin shares the bus, so the hardware CS stays idle
+    spi_config.interface.cs_en = cs_pin < 0;
+    spi_config.intr_enable.val = SPI_MASTER_DEFAULT_INTR_ENABLE;
+    spi_config.mode = SPI_MASTER_MODE;
+    spi_config.clk_div = SPI_10MHz_DIV;
+    spi_init(host, &spi_config);
+    bus->lock = xSemaphoreCreateMutex();
+}
+
+void SX1278_hal_spi_deinit(int host, int cs_pin)
+{
+    SpiHost* bus = &spi_hosts[host];
+    if (bus->users == 0 || --bus->users > 0)
+    {
+        return;
+    }
+    spi_deinit(host);
+    vSemaphoreDelete(bus->lock);
+    bus->lock = NULL;
+}
+
+void SX1278_hal_spi_transfer(int host, int cs_pin, uint8_t cmd, const uint8_t* mosi, uint8_t* miso, uint8_t len)
+{
+    uint32_t words[SX1278_HAL_SPI_MAX_CHUNK / sizeof(uint32_t)];
+    uint16_t trans_cmd = cmd;
+    spi_trans_t trans = {0};
+
+    trans.cmd = &trans_cmd;
+    trans.bits.cmd = 8;
+    if (mosi != NULL)
+    {
+        memcpy(words, mosi, len);
+        trans.mosi = words;
+        trans.bits.mosi = 8 * len;
+    }
+    else
+    {
+        trans.miso = words;
+        trans.bits.miso = 8 * len;
+    }
+
+    xSemaphoreTake(spi_hosts[host].lock, portMAX_DELAY);
+    if (cs_pin >= 0)
+    {
+        gpio_set_level(cs_pin, 0);
+    }
+    spi_trans(host, &trans);
+    if (cs_pin >= 0)
+    {
+        gpio_set_level(cs_pin, 1);
+    }
+    xSemaphoreGive(spi_hosts[host].lock);
+
+    if (miso != NULL)
+    {
+        memcpy(miso, words, len);
+    }
+}
+
+uint32_t SX1278_hal_time_us()
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void SX1278_hal_delay_us(uint32_t us)
+{
+    ets_delay_us(us);
+}
+
+void SX1278_hal_delay_ms(uint32_t ms)
+{
+    vTaskDelay(to_ticks(ms));
+}
+
+uint32_t SX1278_hal_random()
+{
+    return esp_random();
+}
+
+void SX1278_hal_gpio_output(int pin)
+{
+    gpio_config_t io_conf;
+    io_conf.intr_type = GPIO_INTR_DISABLE;
+    io_conf.mode = GPIO_MODE_OUTPUT;
+    io_conf.pin_bit_mask = 1ULL<<pin;
+    io_conf.pull_down_en = 0;
+    io_conf.pull_up_en = 0;
+
+    gpio_config(&io_conf);
+}
+
+void SX1278_hal_gpio_set_level(int pin, uint32_t level)
+{
+    gpio_set_level(pin, level);
+}
+
+void SX1278_hal_gpio_attach_isr(int pin, SX1278IsrHandler handler, void* arg)
+{
+    gpio_config_t io_conf;
+    io_conf.intr_type = GPIO_INTR_POSEDGE;
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pin_bit_mask = 1ULL<<pin;
+    io_conf.pull_down_en = 0;
+    io_conf.pull_up_en = 0;
+
+    gpio_config(&io_conf);
+    if (!isr_service_installed)
+    {
+        gpio_install_isr_service(0);
+        isr_service_installed = 1;
+    }
+    gpio_isr_handler_add(pin, handler, arg);
+}
+
+void SX1278_hal_gpio_detach_isr(int pin)
+{
+    gpio_isr_handler_remove(pin);
+}
+
+void SX1278_hal_enter_critical()
+{
+    portENTER_CRITICAL();
+}
+
+void SX1278_hal_exit_critical()
+{
+    portEXIT_CRITICAL();
+}
+
+SX1278Task SX1278_hal_task_create(SX1278TaskFunction function, const char* name, uint32_t stack_size, void* arg, uint32_t priority)
+{
+    TaskHandle_t task = NULL;
+    xTaskCreate(function, name, stack_size, arg, tskIDLE_PRIORITY + priority, &task);
+    return task;
+}
+
+void SX1278_hal_task_exit()
+{
+    vTaskDelete(NULL);
+}
+
+SX1278Task SX1278_hal_task_self()
+{
+    return xTaskGetCurrentTaskHandle();
+}
+
+void SX1278_hal_task_notify(SX1278Task task)
+{
+    xTaskNotifyGive(task);
+}
+
+uint32_t SX1278_hal_task_wait(uint8_t clear, uint32_t timeout_ms)
+{
+    return ulTaskNotifyTake(clear ? pdTRUE : pdFALSE, to_ticks(timeout_ms));
+}
+
+SX1278Queue SX1278_hal_queue_create(uint32_t length, uint32_t item_size)
+{
+    return xQueueCreate(length, item_size);
+}
+
+void SX1278_hal_queue_delete(SX1278Queue queue)
+{
+    vQueueDelete(queue);
+}
+
+uint8_t SX1278_hal_queue_send(SX1278Queue queue, const void* item, uint32_t timeout_ms)
+{
+    return xQueueSend(queue, item, to_ticks(timeout_ms)) == pdTRUE;
+}
+
+uint8_t SX1278_hal_queue_send_from_isr(SX1278Queue queue, const void* item)
+{
+    BaseType_t woken = pdFALSE;
+    uint8_t sent = xQueueSendFromISR(queue, item, &woken) == pdTRUE;
+    // Switch to the worker on return from the interrupt instead of at the next tick
+    if (woken == pdTRUE)
+    {
+        portYIELD_FROM_ISR();
+    }
+    return sent;
+}
+
+uint8_t SX1278_hal_queue_receive(SX1278Queue queue, void* item, uint32_t timeout_ms)
+{
+    return xQueueReceive(queue, item, to_ticks(timeout_ms)) == pdTRUE;
+}
+
+uint32_t SX1278_hal_queue_count(SX1278Queue queue)
+{
+    return uxQueueMessagesWaiting(queue);
+}
+
+SX1278Semaphore SX1278_hal_semaphore_create()
+{
+    return xSemaphoreCreateBinary();
+}
+
+void SX1278_hal_semaphore_delete(SX1278Semaphore semaphore)
+{
+    vSemaphoreDelete(semaphore);
+}
+
+void SX1278_hal_semaphore_give(SX1278Semaphore semaphore)
+{
+    xSemaphoreGive(semaphore);
+}
+
+uint8_t SX1278_hal_semaphore_take(SX1278Semaphore semaphore, uint32_t timeout_ms)
+{
+    return xSemaphoreTake(semaphore, to_ticks(timeout_ms)) == pdTRUE;
+}
@@ -0,0 +1,76 @@
+#include "SX1278Pool.h"
+#include "SX1278Hal.h"
+#include "stddef.h"
+#include "string.h"
+
+static PacketBuffer blocks[SX1278_POOL_BLOCKS];
+static PacketBuffer* free_list = NULL;
+static uint8_t initialized = 0;
+static PoolStats pool_stats = { .capacity = SX1278_POOL_BLOCKS };
+
+
+static void pool_init()
+{
+    for (uint32_t i = 0; i < SX1278_POOL_BLOCKS; i++)
+    {
+        blocks[i].next = free_list;
+        free_list = &blocks[i];
+    }
+    initialized = 1;
+}
+
+PacketBuffer* SX1278_pool_alloc()
+{
+    PacketBuffer* buffer;
+    SX1278_hal_enter_critical();
+    if (!initialized)
+    {
+        pool_init();
+    }
+    buffer = free_list;
+    if (buffer != NULL)
+    {
+        free_list = buffer->next;
+        buffer->next = NULL;
+        if (++pool_stats.in_use > pool_stats.high_water)
+        {
+            pool_stats.high_water = pool_stats.in_use;
+        }
+    }
+    else
+    {
+        pool_stats.failures++;
+    }
+    SX1278_hal_exit_critical();
+    return buffer;
+}
+
+void SX1278_pool_free(PacketBuffer* buffer)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    SX1278_hal_enter_critical();
+    buffer->next = free_list;
+    free_list = buffer;
+    pool_stats.in_use--;
+    SX1278_hal_exit_critical();
+}
+
+PacketBuffer* SX1278_pool_from_payload(const uint8_t* payload)
+{
+    const uint8_t* base = (const uint8_t*)blocks;
+    if (payload < base || payload >= base + sizeof(blocks))
+    {
+        return NULL;
+    }
+    return &blocks[(payload - base) / sizeof(PacketBuffer)];
+}
+
+void SX1278_pool_get_stats(PoolStats* stats)
+{
+    SX1278_hal_enter_critical();
+    memcpy(stats, &pool_stats, sizeof(PoolStats));
+    SX1278_hal_exit_critical();
+}
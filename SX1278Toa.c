@@ -0,0 +1,46 @@
+#include "SX1278Toa.h"
+
+// Exact LoRa bandwidths in millihertz, the kHz names in Bandwidth are rounded
+static const uint32_t bandwidth_mhz[] = {
+    7812500, 10416667, 15625000, 20833333, 31250000,
+    41666667, 62500000, 125000000, 250000000, 500000000
+};
+
+
+uint32_t SX1278_bandwidth_hz(Bandwidth bw)
+{
+    return (bandwidth_mhz[bw] + 500) / 1000;
+}
+
+void SX1278_toa_prepare(ToaParams* params, SpreadingFactor sf, Bandwidth bw, CodingRate cr, uint16_t preamble_len, uint8_t implicit_header, uint8_t crc_on, uint8_t low_data_rate)
+{
+    // Symbol time in microseconds with TOA_FRACTION_BITS of fraction: 2^SF / BW
+    uint64_t numerator = ((uint64_t)1000000000 << (sf + TOA_FRACTION_BITS));
+    params->symbol_q = (uint32_t)((numerator + bandwidth_mhz[bw] / 2) / bandwidth_mhz[bw]);
+
+    // Preamble plus 4.25 symbols of sync word and start frame delimiter
+    params->preamble_q = ((uint64_t)(4 * (uint32_t)preamble_len + 17) * params->symbol_q) / 4;
+
+    params->payload_offset = 28 - 4 * sf + 16 * (crc_on ? 1 : 0) - 20 * (implicit_header ? 1 : 0);
+    params->divisor = 4 * (sf - 2 * (low_data_rate ? 1 : 0));
+    params->coding_rate = cr + 4;
+}
+
+uint32_t SX1278_toa_payload_symbols(const ToaParams* params, uint8_t payload_len)
+{
+    int32_t numerator = 8 * (int32_t)payload_len + params->payload_offset;
+    uint32_t blocks = numerator > 0 ? ((uint32_t)numerator + params->divisor - 1) / params->divisor : 0;
+    return 8 + blocks * params->coding_rate;
+}
+
+uint32_t SX1278_toa_us(const ToaParams* params, uint8_t payload_len)
+{
+    uint64_t payload_q = (uint64_t)SX1278_toa_payload_symbols(params, payload_len) * params->symbol_q;
+    uint64_t toa = (params->preamble_q + payload_q + (1 << (TOA_FRACTION_BITS - 1))) >> TOA_FRACTION_BITS;
+    return toa > UINT32_MAX ? UINT32_MAX : (uint32_t)toa;
+}
+
+uint32_t SX1278_toa_symbol_us(const ToaParams* params)
+{
+    return (params->symbol_q + (1 << (TOA_FRACTION_BITS - 1))) >> TOA_FRACTION_BITS;
+}
@@ -2,10 +2,41 @@
 #define SX1278_H
 
 #include "SX1278Def.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "SX1278Pool.h"
+#include "SX1278Toa.h"
+#include "SX1278Hal.h"
+#include "sdkconfig.h"
 
-#define MAX_FIFO_BUFFER             256
+#ifndef SX1278_MAX_DEVICES
+#define SX1278_MAX_DEVICES          2
+#endif
+
+#ifndef SX1278_TX_QUEUE_LENGTH
+#define SX1278_TX_QUEUE_LENGTH      4
+#endif
+
+#ifndef SX1278_RX_RING_LENGTH
+#define SX1278_RX_RING_LENGTH       4
+#endif
+
+#ifndef SX1278_MAX_HOP_CHANNELS
+#define SX1278_MAX_HOP_CHANNELS     16
+#endif
+
+#ifndef SX1278_MAX_PLAN_CHANNELS
+#define SX1278_MAX_PLAN_CHANNELS    16
+#endif
+
+#define SX1278_SHADOW_SIZE          (REG_VERSION + 1)
+#define SX1278_MODE_COUNT           8
+// Bucket i counts IRQ latencies below 32 << i us, the last one everything above
+#define SX1278_LATENCY_BUCKETS      8
+
+#ifdef CONFIG_SX1278_TRACE
+#ifndef CONFIG_SX1278_TRACE_LENGTH
+#define CONFIG_SX1278_TRACE_LENGTH  64
+#endif
+#endif
 
 #define DEFAULT_PREAMBLE_LENGTH     0x08
 #define DEFAULT_MODEM_CONFIG1       0x72
@@ -15,7 +46,13 @@
 #define DEFAULT_INVERT_IQ           0x66
 #define DEFAULT_PA_CONFIG           0x8f
 
+#define DEFAULT_SX1278_SPI_HOST     1
+#define DEFAULT_SX1278_CS_PIN       -1
 #define DEFAULT_SX1278_RESET_PIN    0x00
+#define DEFAULT_SX1278_DIO0_PIN     0x04
+#define DEFAULT_SX1278_DIO1_PIN     0x05
+#define SX1278_PIN_UNUSED           -1
+#define SX1278_DIO_COUNT            6
 
 #define DEFAULT_SX1278_FREQUENCY    0x6C8000
 #define MID_RANGE_FREQ_THRESHOLD    0x834000
@@ -23,40 +60,247 @@
 #define RSSI_OFFSET_LF              -164
 
 
-typedef struct FIFO_struct
+typedef struct RxRing_struct
 {
-    uint8_t expected_size;
-    uint8_t size;
-    uint8_t buffer[MAX_FIFO_BUFFER];
-} FIFO;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t overflows;
+    PacketBuffer* packets[SX1278_RX_RING_LENGTH];
+} RxRing;
 
-typedef struct PacketStatus_struct
+typedef struct SX1278Config_struct
 {
-    double snr;
-    double rssi;
-} PacketStatus;
+    int spi_host;
+    int cs_pin;
+    int reset_pin;
+    int dio_pins[SX1278_DIO_COUNT];
+    uint8_t warm_start;
+} SX1278Config;
+
+#define SX1278_DEFAULT_CONFIG() {                                           \
+    .spi_host = DEFAULT_SX1278_SPI_HOST,                                    \
+    .cs_pin = DEFAULT_SX1278_CS_PIN,                                        \
+    .reset_pin = DEFAULT_SX1278_RESET_PIN,                                  \
+    .dio_pins = {                                                           \
+        DEFAULT_SX1278_DIO0_PIN, DEFAULT_SX1278_DIO1_PIN,                   \
+        SX1278_PIN_UNUSED, SX1278_PIN_UNUSED,                               \
+        SX1278_PIN_UNUSED, SX1278_PIN_UNUSED,                               \
+    },                                                                      \
+    .warm_start = 0,                                                        \
+}
+
+typedef struct SX1278ChannelPlan_struct
+{
+    uint8_t count;
+    uint32_t frf[SX1278_MAX_PLAN_CHANNELS];
+} SX1278ChannelPlan;
+
+typedef struct SX1278Lbt_struct
+{
+    uint8_t enabled;
+    uint8_t max_attempts;
+    uint16_t slot_ms;
+} SX1278Lbt;
+
+#define SX1278_LBT_DEFAULT() {                                              \
+    .enabled = 1,                                                           \
+    .max_attempts = 8,                                                      \
+    .slot_ms = 10,                                                          \
+}
+
+typedef struct SpiStats_struct
+{
+    uint32_t transactions;
+    uint32_t bytes;
+} SpiStats;
+
+typedef struct SX1278Stats_struct
+{
+    uint32_t tx_packets;
+    uint32_t rx_packets;
+    uint32_t crc_errors;
+    uint32_t header_errors;
+    uint32_t rx_timeouts;
+    uint32_t rx_overflows;
+    uint32_t tx_queue_full;
+    uint32_t irq_dropped;
+    uint32_t cad_runs;
+    uint32_t cad_busy;
+    uint32_t lbt_backoffs;
+    uint32_t lbt_backoff_ms;
+    uint32_t lbt_dropped;
+    uint32_t sniff_detected;
+    uint32_t sniff_missed;
+    uint32_t hops;
+    uint32_t replies;
+    uint32_t turnaround_us;
+    uint32_t turnaround_max_us;
+    uint32_t rx_stream_bytes;
+    SpiStats spi;
+    uint32_t irq_latency[SX1278_LATENCY_BUCKETS];
+    uint32_t irq_latency_max_us;
+    uint32_t mode_dwell_us[SX1278_MODE_COUNT];
+} SX1278Stats;
+
+typedef enum TraceEvent_enum
+{
+    TraceIrq = 0,
+    TraceTxStart,
+    TraceTxDone,
+    TraceRxStart,
+    TraceRxDone,
+    TraceRxTimeout,
+    TraceCrcError,
+    TraceHeaderError,
+    TraceCadStart,
+    TraceCadDone,
+    TraceSwitchMode,
+} TraceEvent;
+
+typedef struct TraceRecord_struct
+{
+    uint32_t timestamp;
+    uint8_t event;
+    uint8_t mode;
+    uint8_t arg;
+} TraceRecord;
+
+typedef enum OpStatus_enum
+{
+    OpPending = 0,
+    OpDone,
+    OpCrcError,
+    OpTimeout,
+    OpAborted,
+} OpStatus;
+
+typedef struct SX1278Op_struct SX1278Op;
+typedef void (*SX1278OpCallback)(SX1278Op* op, void* arg);
+
+// Caller-owned, it has to stay valid until the operation completes
+struct SX1278Op_struct
+{
+    OpStatus status;
+    PacketStatus packet;
+    SX1278OpCallback callback;
+    void* arg;
+    SX1278Task waiter;
+    volatile uint8_t done;
+};
 
 typedef struct SX1278_struct
 {
-    FIFO fifo;
+    SX1278Config config;
     PacketStatus pkt_status;
-    TaskHandle_t tx_done_handle;
-    TaskHandle_t rx_done_handle;
+    RxRing rx_ring;
+    const uint8_t* tx_inflight;
+    uint8_t tx_inflight_size;
+    uint8_t* rx_buffer;
+    SX1278Op* tx_op;
+    SX1278Op* rx_op;
+    const uint8_t* reply;
+    uint8_t reply_size;
+    uint8_t reply_loaded;
+    uint8_t replying;
+    SX1278Op* reply_op;
+    uint8_t rx_streaming;
+    uint8_t* stream_dst;
+    PacketBuffer* stream_packet;
+    uint8_t rx_next;
+    uint8_t stream_start;
+    uint8_t stream_mark;
+    uint8_t stream_read;
+    uint8_t expected_size;
+    SX1278Task tx_done_handle;
+    SX1278Task rx_done_handle;
+    SX1278Task cad_done_handle;
+    SX1278Task worker_task;
+    SX1278Queue cmd_queue;
+    SX1278Queue tx_queue;
+    SX1278Semaphore sync_lock;
+    SX1278Semaphore sync_done;
+    OperationMode mode;
+    HeaderMode header_mode;
+    HeaderMode rx_header_mode;
+    uint8_t resume_rx;
+    uint8_t cad_detected;
+    SX1278Lbt lbt;
+    uint8_t lbt_attempt;
+    uint8_t lbt_cad;
+    uint8_t lbt_backoff;
+    uint32_t lbt_resume_us;
+    uint8_t sniffing;
+    uint8_t sniff_cad;
+    uint8_t sniff_symb_timeout;
+    HeaderMode sniff_header_mode;
+    uint32_t sniff_wake_us;
+    struct ScanJob_struct* scan_job;
+    uint32_t hop_table[SX1278_MAX_HOP_CHANNELS];
+    uint8_t hop_count;
+    SpiStats spi_stats;
+    uint8_t shadow[SX1278_SHADOW_SIZE];
+    uint8_t shadow_valid[(SX1278_SHADOW_SIZE + 7) / 8];
+    uint32_t shadow_mismatches;
     SX1278Settings settings;
+    ToaParams toa;
+    uint8_t low_data_rate;
+    uint32_t ready_us;
+    SX1278Stats stats;
+    uint32_t mode_since;
+#ifdef CONFIG_SX1278_TRACE
+    TraceRecord trace[CONFIG_SX1278_TRACE_LENGTH];
+    uint32_t trace_head;
+#endif
 } SX1278;
 
-SX1278* SX1278_create();
+SX1278* SX1278_create(const SX1278Config* config);
 void SX1278_destroy(SX1278* dev);
 void SX1278_switch_mode(SX1278* dev, OperationMode mode);
-void SX1278_fill_fifo(SX1278* dev, uint8_t* data, uint8_t len);
-void SX1278_start_tx(SX1278* dev);
+uint8_t* SX1278_tx_lease(SX1278* dev);
+uint8_t SX1278_transmit(SX1278* dev, const uint8_t* data, uint8_t len, uint32_t wait_ms);
+uint8_t SX1278_enqueue_tx(SX1278* dev, const uint8_t* data, uint8_t len, uint32_t wait_ms);
+uint32_t SX1278_tx_pending(SX1278* dev);
 void SX1278_start_rx(SX1278* dev, OperationMode rx_mode, HeaderMode header_mode);
+void SX1278_receive_into(SX1278* dev, uint8_t* buffer, HeaderMode header_mode);
+void SX1278_start_cad(SX1278* dev);
+void SX1278_op_init(SX1278Op* op, SX1278OpCallback callback, void* arg);
+OpStatus SX1278_op_wait(SX1278Op* op, uint32_t timeout_ms);
+uint8_t SX1278_transmit_async(SX1278* dev, const uint8_t* data, uint8_t len, SX1278Op* op, uint32_t wait_ms);
+void SX1278_receive_async(SX1278* dev, OperationMode rx_mode, HeaderMode header_mode, uint8_t* buffer, SX1278Op* op);
+uint8_t SX1278_stage_reply(SX1278* dev, const uint8_t* data, uint8_t len, SX1278Op* op);
+void SX1278_set_lbt(SX1278* dev, const SX1278Lbt* lbt);
+uint8_t SX1278_set_rx_streaming(SX1278* dev, uint8_t enabled);
+void SX1278_start_sniff(SX1278* dev, HeaderMode header_mode);
+uint32_t SX1278_get_sniff_interval_us(SX1278* dev);
+uint8_t SX1278_set_hop_table(SX1278* dev, const uint32_t* frf, uint8_t count, uint8_t period);
 uint8_t SX1278_get_fifo(SX1278* dev, uint8_t* data);
-void SX1278_reset();
+PacketBuffer* SX1278_rx_peek(SX1278* dev);
+void SX1278_rx_release(SX1278* dev);
+PacketBuffer* SX1278_rx_take(SX1278* dev);
+uint32_t SX1278_rx_available(SX1278* dev);
+uint32_t SX1278_rx_overflows(SX1278* dev);
+uint8_t SX1278_reset(SX1278* dev);
+uint32_t SX1278_get_ready_us(SX1278* dev);
 void SX1278_set_frequency(SX1278* device, ChannelFrequency freq);
+uint32_t SX1278_hz_to_frf(uint32_t hz);
+uint32_t SX1278_frf_to_hz(uint32_t frf);
+void SX1278_set_frequency_hz(SX1278* device, uint32_t hz);
+uint8_t SX1278_channel_plan_init(SX1278ChannelPlan* plan, uint32_t first_hz, uint32_t spacing_hz, uint8_t count);
+uint8_t SX1278_set_channel(SX1278* device, const SX1278ChannelPlan* plan, uint8_t index);
+uint8_t SX1278_scan_channels(SX1278* dev, const SX1278ChannelPlan* plan, int16_t* rssi, uint32_t dwell_us);
 void SX1278_set_txpower(SX1278* device, TxPower txpower);
-double SX1278_get_toa(SX1278* device);
+uint32_t SX1278_get_toa_us(SX1278* device, uint8_t payload_len);
 void SX1278_initialize(SX1278* device, SX1278Settings* settings);
+void SX1278_prepare_fifo(SX1278* dev, uint8_t len);
+void SX1278_set_implicit_header(SX1278* device, uint8_t payload_len, uint8_t crc_on);
+uint32_t SX1278_reconfigure(SX1278* device, SX1278Settings* settings);
+void SX1278_get_spi_stats(SX1278* dev, SpiStats* stats);
+void SX1278_reset_spi_stats(SX1278* dev);
+uint32_t SX1278_verify_shadow(SX1278* dev);
+void SX1278_get_stats(SX1278* dev, SX1278Stats* stats);
+void SX1278_reset_stats(SX1278* dev);
+uint32_t SX1278_trace_read(SX1278* dev, TraceRecord* records, uint32_t max);
+void SX1278_trace_dump(SX1278* dev);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef SX1278AGGREGATOR_H
+#define SX1278AGGREGATOR_H
+
+#include "SX1278.h"
+
+#ifndef SX1278_AGGREGATOR_MAX_MESSAGE
+#define SX1278_AGGREGATOR_MAX_MESSAGE   32
+#endif
+
+#ifndef SX1278_AGGREGATOR_QUEUE_LENGTH
+#define SX1278_AGGREGATOR_QUEUE_LENGTH  16
+#endif
+
+#define SX1278_AGGREGATOR_MAX_FRAME     255
+// Deadlines are compared as signed microsecond differences
+#define SX1278_AGGREGATOR_MAX_DEADLINE_MS   (INT32_MAX / 1000)
+
+
+typedef struct SX1278AggregatorStats_struct
+{
+    uint32_t messages;
+    uint32_t frames;
+    uint32_t flush_full;
+    uint32_t flush_deadline;
+    uint32_t dropped;
+    uint32_t airtime_us;
+    uint32_t airtime_saved_us;
+} SX1278AggregatorStats;
+
+typedef enum AggregatorCommand_enum
+{
+    AggregatorData = 0,
+    AggregatorFlush,
+    AggregatorStop,
+} AggregatorCommand;
+
+typedef struct AggregatorMessage_struct
+{
+    AggregatorCommand command;
+    uint8_t size;
+    uint32_t deadline_us;
+    uint8_t data[SX1278_AGGREGATOR_MAX_MESSAGE];
+} AggregatorMessage;
+
+typedef struct SX1278Aggregator_struct
+{
+    SX1278* dev;
+    uint8_t max_frame;
+    uint8_t frame[SX1278_AGGREGATOR_MAX_FRAME];
+    uint8_t size;
+    uint8_t count;
+    uint32_t deadline_us;
+    uint32_t unaggregated_us;
+    SX1278Queue messages;
+    SX1278Task task;
+    SX1278Semaphore stopped;
+    SX1278AggregatorStats stats;
+} SX1278Aggregator;
+
+SX1278Aggregator* SX1278_aggregator_create(SX1278* dev, uint8_t max_frame);
+void SX1278_aggregator_destroy(SX1278Aggregator* aggregator);
+uint8_t SX1278_aggregator_send(SX1278Aggregator* aggregator, const uint8_t* data, uint8_t len, uint32_t deadline_ms, uint32_t wait_ms);
+void SX1278_aggregator_flush(SX1278Aggregator* aggregator);
+uint8_t SX1278_aggregator_next(const uint8_t* frame, uint8_t size, uint8_t* offset, const uint8_t** data, uint8_t* len);
+void SX1278_aggregator_get_stats(SX1278Aggregator* aggregator, SX1278AggregatorStats* stats);
+
+
+#endif //SX1278AGGREGATOR_H
@@ -3,6 +3,8 @@
 
 #include "stdint.h"
 
+#define MAX_FIFO_BUFFER                 256
+
 #define REG_FIFO                        0x00
 #define REG_OPMODE                      0x01
 #define REG_FR_MSB                      0x06
@@ -48,6 +50,8 @@
 #define REG_DETECTION_THRESHOLD         0x37
 #define REG_SYNC_WORD                   0x39
 #define REG_INVERT_IQ2                  0x3B
+#define REG_DIO_MAPPING_1               0x40
+#define REG_DIO_MAPPING_2               0x41
 #define REG_VERSION                     0x42
 
 
@@ -157,5 +161,13 @@ typedef struct SX1278Settings_struct
     uint8_t sync_word;
 } SX1278Settings;
 
+typedef struct PacketStatus_struct
+{
+    uint8_t size;
+    int8_t snr;
+    int16_t rssi;
+    uint32_t timestamp;
+} PacketStatus;
+
 
 #endif //SX1278DEF_H
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef SX1278GATEWAY_H
+#define SX1278GATEWAY_H
+
+#include "SX1278.h"
+
+#ifndef SX1278_GATEWAY_MAX_RADIOS
+#define SX1278_GATEWAY_MAX_RADIOS   SX1278_MAX_DEVICES
+#endif
+
+#ifndef SX1278_GATEWAY_MAX_TARGETS
+#define SX1278_GATEWAY_MAX_TARGETS  8
+#endif
+
+#ifndef SX1278_GATEWAY_QUEUE_LENGTH
+#define SX1278_GATEWAY_QUEUE_LENGTH 8
+#endif
+
+#define SX1278_GATEWAY_ROTATING     0xff
+
+
+typedef struct SX1278ListenTarget_struct
+{
+    uint32_t frf;
+    SpreadingFactor sf;
+    Bandwidth bw;
+} SX1278ListenTarget;
+
+typedef struct SX1278Uplink_struct
+{
+    PacketBuffer* packet;
+    SX1278ListenTarget target;
+    uint8_t target_index;
+    uint8_t radio_index;
+} SX1278Uplink;
+
+typedef struct SX1278GatewayStats_struct
+{
+    uint32_t received;
+    uint32_t dropped;
+    uint32_t cad_runs;
+    uint32_t cad_detected;
+    uint32_t rx_missed;
+    uint32_t per_target[SX1278_GATEWAY_MAX_TARGETS];
+} SX1278GatewayStats;
+
+typedef struct GatewayRadio_struct
+{
+    SX1278* dev;
+    uint8_t target;
+    uint8_t receiving;
+    uint32_t cad_runs;
+    uint32_t cad_busy;
+    uint32_t rx_events;
+    uint32_t rx_packets;
+} GatewayRadio;
+
+typedef struct SX1278Gateway_struct
+{
+    GatewayRadio radios[SX1278_GATEWAY_MAX_RADIOS];
+    volatile uint8_t radio_count;
+    SX1278ListenTarget targets[SX1278_GATEWAY_MAX_TARGETS];
+    uint8_t target_count;
+    uint8_t first_rotating;
+    SX1278Settings base;
+    SX1278Queue uplinks;
+    SX1278Task task;
+    SX1278Task stop_caller;
+    volatile uint8_t running;
+    SX1278GatewayStats stats;
+} SX1278Gateway;
+
+SX1278Gateway* SX1278_gateway_create(SX1278* const* radios, uint8_t radio_count,
+    const SX1278ListenTarget* targets, uint8_t target_count, const SX1278Settings* base);
+void SX1278_gateway_destroy(SX1278Gateway* gateway);
+uint8_t SX1278_gateway_receive(SX1278Gateway* gateway, SX1278Uplink* uplink, uint32_t wait_ms);
+void SX1278_gateway_release(SX1278Uplink* uplink);
+uint8_t SX1278_gateway_target_radio(SX1278Gateway* gateway, uint8_t target);
+void SX1278_gateway_get_stats(SX1278Gateway* gateway, SX1278GatewayStats* stats);
+
+
+#endif //SX1278GATEWAY_H
@@ -0,0 +1,52 @@
+#ifndef SX1278HAL_H
+#define SX1278HAL_H
+
+#include "stdint.h"
+
+#define SX1278_HAL_SPI_MAX_CHUNK    64
+#define SX1278_WAIT_FOREVER         UINT32_MAX
+
+typedef void* SX1278Task;
+typedef void* SX1278Queue;
+typedef void* SX1278Semaphore;
+typedef void (*SX1278IsrHandler)(void* arg);
+typedef void (*SX1278TaskFunction)(void* arg);
+
+void SX1278_hal_spi_init(int host, int cs_pin);
+void SX1278_hal_spi_deinit(int host, int cs_pin);
+void SX1278_hal_spi_transfer(int host, int cs_pin, uint8_t cmd, const uint8_t* mosi, uint8_t* miso, uint8_t len);
+
+uint32_t SX1278_hal_time_us();
+void SX1278_hal_delay_us(uint32_t us);
+void SX1278_hal_delay_ms(uint32_t ms);
+uint32_t SX1278_hal_random();
+
+void SX1278_hal_gpio_output(int pin);
+void SX1278_hal_gpio_set_level(int pin, uint32_t level);
+void SX1278_hal_gpio_attach_isr(int pin, SX1278IsrHandler handler, void* arg);
+void SX1278_hal_gpio_detach_isr(int pin);
+
+void SX1278_hal_enter_critical();
+void SX1278_hal_exit_critical();
+
+SX1278Task SX1278_hal_task_create(SX1278TaskFunction function, const char* name, uint32_t stack_size, void* arg, uint32_t priority);
+void SX1278_hal_task_exit();
+SX1278Task SX1278_hal_task_self();
+void SX1278_hal_task_notify(SX1278Task task);
+uint32_t SX1278_hal_task_wait(uint8_t clear, uint32_t timeout_ms);
+
+SX1278Queue SX1278_hal_queue_create(uint32_t length, uint32_t item_size);
+void SX1278_hal_queue_delete(SX1278Queue queue);
+uint8_t SX1278_hal_queue_send(SX1278Queue queue, const void* item, uint32_t timeout_ms);
+uint8_t SX1278_hal_queue_send_from_isr(SX1278Queue queue, const void* item);
+uint8_t SX1278_hal_queue_receive(SX1278Queue queue, void* item, uint32_t timeout_ms);
+uint32_t SX1278_hal_queue_count(SX1278Queue queue);
+
+// Binary semaphore, created empty
+SX1278Semaphore SX1278_hal_semaphore_create();
+void SX1278_hal_semaphore_delete(SX1278Semaphore semaphore);
+void SX1278_hal_semaphore_give(SX1278Semaphore semaphore);
+uint8_t SX1278_hal_semaphore_take(SX1278Semaphore semaphore, uint32_t timeout_ms);
+
+
+#endif //SX1278HAL_H
@@ -0,0 +1,32 @@
+#ifndef SX1278POOL_H
+#define SX1278POOL_H
+
+#include "SX1278Def.h"
+
+#ifndef SX1278_POOL_BLOCKS
+#define SX1278_POOL_BLOCKS          8
+#endif
+
+
+typedef struct PacketBuffer_struct
+{
+    struct PacketBuffer_struct* next;
+    PacketStatus status;
+    uint8_t payload[MAX_FIFO_BUFFER];
+} PacketBuffer;
+
+typedef struct PoolStats_struct
+{
+    uint32_t capacity;
+    uint32_t in_use;
+    uint32_t high_water;
+    uint32_t failures;
+} PoolStats;
+
+PacketBuffer* SX1278_pool_alloc();
+void SX1278_pool_free(PacketBuffer* buffer);
+PacketBuffer* SX1278_pool_from_payload(const uint8_t* payload);
+void SX1278_pool_get_stats(PoolStats* stats);
+
+
+#endif //SX1278POOL_H
@@ -0,0 +1,25 @@
+#ifndef SX1278TOA_H
+#define SX1278TOA_H
+
+#include "SX1278Def.h"
+
+#define TOA_FRACTION_BITS           12
+
+
+typedef struct ToaParams_struct
+{
+    uint32_t symbol_q;
+    uint64_t preamble_q;
+    int16_t payload_offset;
+    uint8_t divisor;
+    uint8_t coding_rate;
+} ToaParams;
+
+uint32_t SX1278_bandwidth_hz(Bandwidth bw);
+void SX1278_toa_prepare(ToaParams* params, SpreadingFactor sf, Bandwidth bw, CodingRate cr, uint16_t preamble_len, uint8_t implicit_header, uint8_t crc_on, uint8_t low_data_rate);
+uint32_t SX1278_toa_payload_symbols(const ToaParams* params, uint8_t payload_len);
+uint32_t SX1278_toa_us(const ToaParams* params, uint8_t payload_len);
+uint32_t SX1278_toa_symbol_us(const ToaParams* params);
+
+
+#endif //SX1278TOA_H
@@ -0,0 +1,376 @@
+#include "SX1278HalLinux.h"
+#include "SX1278Sim.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+
+typedef struct LinuxTask_struct
+{
+    pthread_t thread;
+    SX1278TaskFunction function;
+    void* arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notifications;
+} LinuxTask;
+
+typedef struct LinuxQueue_struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    uint32_t length;
+    uint32_t item_size;
+    uint32_t head;
+    uint32_t count;
+    uint8_t* items;
+} LinuxQueue;
+
+static __thread LinuxTask* current_task = NULL;
+static pthread_once_t critical_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t critical_lock;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t epoch;
+static uint64_t epoch_virtual_ns;
+static uint32_t time_scale = 1;
+
+
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void epoch_init()
+{
+    epoch = monotonic_ns();
+}
+
+static uint64_t virtual_ns()
+{
+    pthread_once(&epoch_once, epoch_init);
+    pthread_mutex_lock(&clock_lock);
+    uint64_t ns = epoch_virtual_ns + (monotonic_ns() - epoch) * time_scale;
+    pthread_mutex_unlock(&clock_lock);
+    return ns;
+}
+
+void SX1278_hal_linux_set_time_scale(uint32_t scale)
+{
+    // Rebase so simulated time stays continuous across a scale change
+    uint64_t now = virtual_ns();
+    pthread_mutex_lock(&clock_lock);
+    epoch_virtual_ns = now;
+    epoch = monotonic_ns();
+    time_scale = scale > 0 ? scale : 1;
+    pthread_mutex_unlock(&clock_lock);
+}
+
+uint32_t SX1278_hal_linux_time_scale()
+{
+    return time_scale;
+}
+
+uint64_t SX1278_hal_linux_task_cpu_ns(SX1278Task task)
+{
+    LinuxTask* t = task;
+    clockid_t clock;
+    struct timespec cpu;
+    if (t == NULL || pthread_getcpuclockid(t->thread, &clock) != 0 || clock_gettime(clock, &cpu) != 0)
+    {
+        return 0;
+    }
+    return (uint64_t)cpu.tv_sec * 1000000000ULL + cpu.tv_nsec;
+}
+
+void SX1278_hal_linux_cond_init(pthread_cond_t* cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void SX1278_hal_linux_deadline(uint32_t timeout_us, struct timespec* deadline)
+{
+    uint64_t ns = monotonic_ns() + (uint64_t)timeout_us * 1000 / time_scale;
+    deadline->tv_sec = ns / 1000000000ULL;
+    deadline->tv_nsec = ns % 1000000000ULL;
+}
+
+static int wait_cond(pthread_cond_t* cond, pthread_mutex_t* lock, uint32_t timeout_ms)
+{
+    if (timeout_ms == SX1278_WAIT_FOREVER)
+    {
+        return pthread_cond_wait(cond, lock);
+    }
+    struct timespec deadline;
+    SX1278_hal_linux_deadline(timeout_ms * 1000, &deadline);
+    return pthread_cond_timedwait(cond, lock, &deadline);
+}
+
+void SX1278_hal_spi_init(int host, int cs_pin)
+{
+}
+
+void SX1278_hal_spi_deinit(int host, int cs_pin)
+{
+}
+
+void SX1278_hal_spi_transfer(int host, int cs_pin, uint8_t cmd, const uint8_t* mosi, uint8_t* miso, uint8_t len)
+{
+    SX1278_sim_spi_transfer(host, cs_pin, cmd, mosi, miso, len);
+}
+
+uint32_t SX1278_hal_time_us()
+{
+    return (uint32_t)(virtual_ns() / 1000);
+}
+
+void SX1278_hal_delay_us(uint32_t us)
+{
+    uint64_t ns = (uint64_t)us * 1000 / time_scale;
+    struct timespec delay = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR);
+}
+
+void SX1278_hal_delay_ms(uint32_t ms)
+{
+    SX1278_hal_delay_us(ms * 1000);
+}
+
+uint32_t SX1278_hal_random()
+{
+    return (uint32_t)random();
+}
+
+void SX1278_hal_gpio_output(int pin)
+{
+}
+
+void SX1278_hal_gpio_set_level(int pin, uint32_t level)
+{
+    SX1278_sim_gpio_set_level(pin, level);
+}
+
+void SX1278_hal_gpio_attach_isr(int pin, SX1278IsrHandler handler, void* arg)
+{
+    SX1278_sim_attach_isr(pin, handler, arg);
+}
+
+void SX1278_hal_gpio_detach_isr(int pin)
+{
+    SX1278_sim_attach_isr(pin, NULL, NULL);
+}
+
+static void critical_init()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&critical_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void SX1278_hal_enter_critical()
+{
+    pthread_once(&critical_once, critical_init);
+    pthread_mutex_lock(&critical_lock);
+}
+
+void SX1278_hal_exit_critical()
+{
+    pthread_mutex_unlock(&critical_lock);
+}
+
+static LinuxTask* task_alloc()
+{
+    LinuxTask* task = calloc(1, sizeof(LinuxTask));
+    pthread_mutex_init(&task->lock, NULL);
+    SX1278_hal_linux_cond_init(&task->cond);
+    return task;
+}
+
+static void* task_entry(void* p)
+{
+    current_task = p;
+    current_task->function(current_task->arg);
+    return NULL;
+}
+
+SX1278Task SX1278_hal_task_create(SX1278TaskFunction function, const char* name, uint32_t stack_size, void* arg, uint32_t priority)
+{
+    LinuxTask* task = task_alloc();
+    task->function = function;
+    task->arg = arg;
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0)
+    {
+        free(task);
+        return NULL;
+    }
+    pthread_detach(task->thread);
+    return task;
+}
+
+void SX1278_hal_task_exit()
+{
+    LinuxTask* task = current_task;
+    current_task = NULL;
+    pthread_mutex_destroy(&task->lock);
+    pthread_cond_destroy(&task->cond);
+    free(task);
+    pthread_exit(NULL);
+}
+
+SX1278Task SX1278_hal_task_self()
+{
+    // Threads not started through the HAL, such as main, get a handle on first use
+    if (current_task == NULL)
+    {
+        current_task = task_alloc();
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+void SX1278_hal_task_notify(SX1278Task task)
+{
+    LinuxTask* target = task;
+    pthread_mutex_lock(&target->lock);
+    target->notifications++;
+    pthread_cond_signal(&target->cond);
+    pthread_mutex_unlock(&target->lock);
+}
+
+uint32_t SX1278_hal_task_wait(uint8_t clear, uint32_t timeout_ms)
+{
+    LinuxTask* task = SX1278_hal_task_self();
+    uint32_t value;
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notifications == 0 && timeout_ms != 0)
+    {
+        if (wait_cond(&task->cond, &task->lock, timeout_ms) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    value = task->notifications;
+    if (value > 0)
+    {
+        task->notifications = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+SX1278Queue SX1278_hal_queue_create(uint32_t length, uint32_t item_size)
+{
+    LinuxQueue* queue = calloc(1, sizeof(LinuxQueue));
+    pthread_mutex_init(&queue->lock, NULL);
+    SX1278_hal_linux_cond_init(&queue->not_empty);
+    SX1278_hal_linux_cond_init(&queue->not_full);
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->items = calloc(length, item_size);
+    return queue;
+}
+
+void SX1278_hal_queue_delete(SX1278Queue queue)
+{
+    LinuxQueue* q = queue;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    free(q);
+}
+
+uint8_t SX1278_hal_queue_send(SX1278Queue queue, const void* item, uint32_t timeout_ms)
+{
+    LinuxQueue* q = queue;
+    uint8_t sent = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->length && timeout_ms != 0)
+    {
+        if (wait_cond(&q->not_full, &q->lock, timeout_ms) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    if (q->count < q->length)
+    {
+        memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+        sent = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return sent;
+}
+
+uint8_t SX1278_hal_queue_send_from_isr(SX1278Queue queue, const void* item)
+{
+    return SX1278_hal_queue_send(queue, item, 0);
+}
+
+uint8_t SX1278_hal_queue_receive(SX1278Queue queue, void* item, uint32_t timeout_ms)
+{
+    LinuxQueue* q = queue;
+    uint8_t received = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && timeout_ms != 0)
+    {
+        if (wait_cond(&q->not_empty, &q->lock, timeout_ms) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    if (q->count > 0)
+    {
+        memcpy(item, q->items + q->head * q->item_size, q->item_size);
+        q->head = (q->head + 1) % q->length;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+        received = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return received;
+}
+
+uint32_t SX1278_hal_queue_count(SX1278Queue queue)
+{
+    LinuxQueue* q = queue;
+    pthread_mutex_lock(&q->lock);
+    uint32_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+// A one-slot queue: giving an already given semaphore leaves it given
+SX1278Semaphore SX1278_hal_semaphore_create()
+{
+    return SX1278_hal_queue_create(1, 1);
+}
+
+void SX1278_hal_semaphore_delete(SX1278Semaphore semaphore)
+{
+    SX1278_hal_queue_delete(semaphore);
+}
+
+void SX1278_hal_semaphore_give(SX1278Semaphore semaphore)
+{
+    uint8_t token = 0;
+    SX1278_hal_queue_send(semaphore, &token, 0);
+}
+
+uint8_t SX1278_hal_semaphore_take(SX1278Semaphore semaphore, uint32_t timeout_ms)
+{
+    uint8_t token;
+    return SX1278_hal_queue_receive(semaphore, &token, timeout_ms);
+}
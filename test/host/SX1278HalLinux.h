@@ -0,0 +1,17 @@
+#ifndef SX1278HALLINUX_H
+#define SX1278HALLINUX_H
+
+#include "SX1278Hal.h"
+#include "pthread.h"
+#include "time.h"
+
+// Simulated time runs this many times faster than the host clock
+void SX1278_hal_linux_set_time_scale(uint32_t scale);
+uint32_t SX1278_hal_linux_time_scale();
+// CPU time consumed so far by a task created through the HAL
+uint64_t SX1278_hal_linux_task_cpu_ns(SX1278Task task);
+void SX1278_hal_linux_cond_init(pthread_cond_t* cond);
+void SX1278_hal_linux_deadline(uint32_t timeout_us, struct timespec* deadline);
+
+
+#endif //SX1278HALLINUX_H
@@ -0,0 +1,873 @@
+#include "SX1278Sim.h"
+#include "SX1278HalLinux.h"
+#include "string.h"
+#include "math.h"
+#include "errno.h"
+
+#define SIM_REG_COUNT               0x80
+#define SIM_FSK_PAGE_START          0x0d
+#define SIM_FSK_PAGE_END            0x3f
+#define SIM_MAX_EVENTS              32
+#define SIM_MAX_ISRS                32
+#define SIM_CAD_SYMBOLS             2
+#define SIM_HEADER_SYMBOLS          8
+#define SIM_SYNC_SYMBOLS            4
+#define SIM_HOP_LOG                 64
+
+#define MODE_MASK                   0b00000111
+#define LONG_RANGE_MODE             0b10000000
+
+#define IRQ_RX_TIMEOUT              0b10000000
+#define IRQ_RX_DONE                 0b01000000
+#define IRQ_CRC_ERROR               0b00100000
+#define IRQ_VALID_HEADER            0b00010000
+#define IRQ_TX_DONE                 0b00001000
+#define IRQ_CAD_DONE                0b00000100
+#define IRQ_FHSS_CHANGE_CHANNEL     0b00000010
+#define IRQ_CAD_DETECTED            0b00000001
+
+#define PAYLOAD_CRC_ON              0b00000100
+#define HOP_CHANNEL_MASK            0b00111111
+#define HOP_CRC_ON_PAYLOAD          0b01000000
+#define RSSI_NOISE_FLOOR            20
+#define RSSI_PACKET                 100
+#define SNR_PACKET                  (10 * 4)
+
+typedef enum SimEventType_enum
+{
+    SimTxDone = 0,
+    SimRxHeader,
+    SimRxDone,
+    SimRxTimeout,
+    SimCadDone,
+    SimHop
+} SimEventType;
+
+typedef struct SimEvent_struct
+{
+    uint8_t used;
+    SimEventType type;
+    uint32_t due;
+    SX1278Sim* radio;
+    SX1278Sim* source;
+} SimEvent;
+
+typedef struct SimIsr_struct
+{
+    int pin;
+    SX1278IsrHandler handler;
+    void* arg;
+} SimIsr;
+
+struct SX1278Sim_struct
+{
+    uint8_t used;
+    SX1278Config config;
+    uint8_t in_reset;
+    uint8_t regs[SIM_REG_COUNT];
+    uint8_t fsk_regs[SIM_REG_COUNT];
+    uint8_t fifo[MAX_FIFO_BUFFER];
+    uint8_t dio_levels;
+    uint8_t frame[MAX_FIFO_BUFFER];
+    uint8_t frame_size;
+    uint8_t frame_regs[SIM_REG_COUNT];
+    uint8_t transmitting;
+    uint32_t tx_start;
+    uint32_t tx_end;
+    SX1278Sim* rx_source;
+    uint8_t collided;
+    uint8_t rx_streaming;
+    uint32_t rx_payload_start;
+    uint8_t rx_addr;
+    uint8_t rx_written;
+    uint32_t cad_start;
+    uint8_t hop_pending;
+    uint32_t hop_frf;
+    uint8_t hop_channel_read;
+    SX1278SimHop hop_log[SIM_HOP_LOG];
+    uint8_t hop_log_count;
+    uint32_t spi_bytes;
+    uint32_t rx_done_spi;
+    uint8_t reply_window;
+    SX1278SimStats stats;
+};
+
+typedef struct SimEdge_struct
+{
+    SX1278IsrHandler handler;
+    void* arg;
+} SimEdge;
+
+// DIO mapping value to the IRQ flag it follows, per DIO pin
+static const uint8_t dio_flags[SX1278_DIO_COUNT][4] = {
+    { IRQ_RX_DONE, IRQ_TX_DONE, IRQ_CAD_DONE, 0 },
+    { IRQ_RX_TIMEOUT, IRQ_FHSS_CHANGE_CHANNEL, IRQ_CAD_DETECTED, 0 },
+    { IRQ_FHSS_CHANGE_CHANNEL, IRQ_FHSS_CHANGE_CHANNEL, IRQ_FHSS_CHANGE_CHANNEL, 0 },
+    { IRQ_CAD_DONE, IRQ_VALID_HEADER, IRQ_CRC_ERROR, 0 },
+    { IRQ_CAD_DETECTED, 0, 0, 0 },
+    { 0, 0, 0, 0 },
+};
+
+static const double bandwidth_hz[] = {
+    7812.5, 125000.0 / 12, 15625, 125000.0 / 6, 31250, 125000.0 / 3, 62500, 125000, 250000, 500000
+};
+
+static SX1278Sim radios[SX1278_SIM_MAX_RADIOS];
+static SimEvent events[SIM_MAX_EVENTS];
+static SimIsr isrs[SIM_MAX_ISRS];
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_wake;
+static pthread_t sim_thread;
+static uint8_t sim_started = 0;
+
+
+static uint8_t mode_of(SX1278Sim* radio)
+{
+    return radio->regs[REG_OPMODE] & MODE_MASK;
+}
+
+static uint8_t is_receiving(SX1278Sim* radio)
+{
+    uint8_t mode = mode_of(radio);
+    return (radio->regs[REG_OPMODE] & LONG_RANGE_MODE) && (mode == RxContinuous || mode == RxSingle);
+}
+
+static uint8_t spreading_factor(const uint8_t* regs)
+{
+    uint8_t sf = regs[REG_MODEM_CONFIG2] >> 4;
+    return sf < SF7 ? SF7 : sf > SF12 ? SF12 : sf;
+}
+
+static double symbol_us(const uint8_t* regs)
+{
+    uint8_t bw = regs[REG_MODEM_CONFIG1] >> 4;
+    return (1 << spreading_factor(regs)) * 1e6 / bandwidth_hz[bw > Bw500kHz ? Bw500kHz : bw];
+}
+
+static uint32_t preamble_us(const uint8_t* regs)
+{
+    uint16_t preamble_len = (regs[REG_PREAMBLE_MSB] << 8) | regs[REG_PREAMBLE_LSB];
+    return (uint32_t)((preamble_len + 4.25) * symbol_us(regs));
+}
+
+// Semtech AN1200.13 time-on-air, kept independent of SX1278Toa on purpose
+static uint32_t time_on_air_us(const uint8_t* regs, uint8_t size)
+{
+    int sf = spreading_factor(regs);
+    int cr = (regs[REG_MODEM_CONFIG1] >> 1) & 0b111;
+    int ih = regs[REG_MODEM_CONFIG1] & 1;
+    int crc = (regs[REG_MODEM_CONFIG2] >> 2) & 1;
+    int de = (regs[REG_MODEM_CONFIG3] >> 3) & 1;
+    double n = ceil((8.0 * size - 4 * sf + 28 + 16 * crc - 20 * ih) / (4 * (sf - 2 * de))) * (cr + 4);
+    return preamble_us(regs) + (uint32_t)((8 + (n > 0 ? n : 0)) * symbol_us(regs));
+}
+
+static uint8_t same_channel(const uint8_t* a, const uint8_t* b)
+{
+    return a[REG_FR_MSB] == b[REG_FR_MSB] && a[REG_FR_MID] == b[REG_FR_MID] && a[REG_FR_LSB] == b[REG_FR_LSB]
+        && (a[REG_MODEM_CONFIG1] & 0xf1) == (b[REG_MODEM_CONFIG1] & 0xf1)
+        && (a[REG_MODEM_CONFIG2] & 0xf0) == (b[REG_MODEM_CONFIG2] & 0xf0)
+        && a[REG_SYNC_WORD] == b[REG_SYNC_WORD];
+}
+
+static void reset_registers(SX1278Sim* radio)
+{
+    memset(radio->regs, 0, sizeof(radio->regs));
+    memset(radio->fsk_regs, 0, sizeof(radio->fsk_regs));
+    memset(radio->fifo, 0, sizeof(radio->fifo));
+    radio->regs[REG_OPMODE] = 0x09;
+    radio->regs[REG_FR_MSB] = 0x6c;
+    radio->regs[REG_FR_MID] = 0x80;
+    radio->regs[REG_PA_CONFIG] = 0x4f;
+    radio->regs[REG_PA_RAMP] = 0x09;
+    radio->regs[REG_OCP] = 0x2b;
+    radio->regs[REG_LNA] = 0x20;
+    radio->regs[REG_FIFO_TX_BASE_ADDR] = 0x80;
+    radio->regs[REG_MODEM_CONFIG1] = 0x72;
+    radio->regs[REG_MODEM_CONFIG2] = 0x70;
+    radio->regs[REG_SYMB_TIMOUT_LSB] = 0x64;
+    radio->regs[REG_PREAMBLE_LSB] = 0x08;
+    radio->regs[REG_PAYLOAD_LENGTH] = 0x01;
+    radio->regs[REG_MAX_PAYLOAD_LENGTH] = 0xff;
+    radio->regs[REG_MODEM_CONFIG3] = 0x04;
+    radio->regs[REG_INVERT_IQ] = 0x27;
+    radio->regs[REG_SYNC_WORD] = 0x12;
+    radio->regs[REG_INVERT_IQ2] = 0x1d;
+    radio->regs[REG_VERSION] = 0x12;
+    radio->dio_levels = 0;
+    radio->transmitting = 0;
+    radio->rx_source = NULL;
+    radio->rx_streaming = 0;
+}
+
+static void schedule(SimEventType type, SX1278Sim* radio, SX1278Sim* source, uint32_t due)
+{
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++)
+    {
+        if (!events[i].used)
+        {
+            events[i] = (SimEvent){ .used = 1, .type = type, .due = due, .radio = radio, .source = source };
+            pthread_cond_signal(&sim_wake);
+            return;
+        }
+    }
+}
+
+static void cancel_events(SX1278Sim* radio)
+{
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++)
+    {
+        if (events[i].used && events[i].radio == radio)
+        {
+            events[i].used = 0;
+        }
+    }
+}
+
+static uint32_t frf_of(const uint8_t* regs)
+{
+    return (regs[REG_FR_MSB] << 16) | (regs[REG_FR_MID] << 8) | regs[REG_FR_LSB];
+}
+
+// The preamble and header go out on the first channel, then the radio hops every HOP_PERIOD symbols
+static void start_hopping(SX1278Sim* radio, SX1278Sim* source, uint32_t header_end)
+{
+    radio->regs[REG_HOP_CHANNEL] &= ~HOP_CHANNEL_MASK;
+    radio->hop_pending = 0;
+    if (radio->regs[REG_HOP_PERIOD] > 0)
+    {
+        schedule(SimHop, radio, source, header_end);
+    }
+}
+
+// By the next hop, or the end of the frame, the host must have programmed a new frequency
+static void check_hop(SX1278Sim* radio)
+{
+    uint32_t frf = frf_of(radio->regs);
+    if (radio->hop_pending && frf == radio->hop_frf)
+    {
+        radio->stats.missed_hops++;
+    }
+    radio->hop_pending = 0;
+}
+
+static void abort_transmission(SX1278Sim* radio)
+{
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++)
+    {
+        if (events[i].used && events[i].source == radio)
+        {
+            events[i].radio->rx_source = NULL;
+            events[i].used = 0;
+        }
+    }
+    radio->transmitting = 0;
+}
+
+static void set_irq(SX1278Sim* radio, uint8_t flags)
+{
+    radio->regs[REG_IRQ_FLAGS] |= flags & ~radio->regs[REG_IRQ_FLAGS_MASK];
+}
+
+static void enter_mode(SX1278Sim* radio, uint8_t mode)
+{
+    radio->regs[REG_OPMODE] = (radio->regs[REG_OPMODE] & ~MODE_MASK) | mode;
+}
+
+static void start_tx(SX1278Sim* radio, uint32_t now)
+{
+    uint8_t base = radio->regs[REG_FIFO_TX_BASE_ADDR];
+    radio->frame_size = radio->regs[REG_PAYLOAD_LENGTH];
+    for (uint16_t i = 0; i < radio->frame_size; i++)
+    {
+        radio->frame[i] = radio->fifo[(uint8_t)(base + i)];
+    }
+    memcpy(radio->frame_regs, radio->regs, sizeof(radio->regs));
+    radio->transmitting = 1;
+    radio->tx_start = now;
+    radio->tx_end = now + time_on_air_us(radio->regs, radio->frame_size);
+    if (radio->reply_window)
+    {
+        radio->reply_window = 0;
+        radio->stats.reply_spi_bytes = radio->spi_bytes - radio->rx_done_spi;
+    }
+    radio->stats.frames_sent++;
+    radio->stats.airtime_us += radio->tx_end - now;
+    schedule(SimTxDone, radio, NULL, radio->tx_end);
+    start_hopping(radio, NULL, now + preamble_us(radio->regs) + (uint32_t)(SIM_HEADER_SYMBOLS * symbol_us(radio->regs)));
+
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        SX1278Sim* rx = &radios[i];
+        if (rx == radio || !rx->used || rx->in_reset || !is_receiving(rx) || !same_channel(rx->regs, radio->regs))
+        {
+            continue;
+        }
+        if (rx->rx_source != NULL)
+        {
+            rx->collided = 1;
+            rx->stats.collisions++;
+            continue;
+        }
+        cancel_events(rx);
+        rx->rx_source = radio;
+        rx->collided = 0;
+        rx->rx_streaming = 0;
+        uint32_t header_end = now + preamble_us(radio->regs) + (uint32_t)(SIM_HEADER_SYMBOLS * symbol_us(radio->regs));
+        schedule(SimRxHeader, rx, radio, header_end);
+        schedule(SimRxDone, rx, radio, radio->tx_end);
+        start_hopping(rx, radio, header_end);
+    }
+}
+
+// A receiver switched on early enough in a preamble still syncs to the frame
+static uint8_t join_transmission(SX1278Sim* rx, uint32_t now)
+{
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        SX1278Sim* tx = &radios[i];
+        if (tx == rx || !tx->used || !tx->transmitting || !same_channel(rx->regs, tx->frame_regs))
+        {
+            continue;
+        }
+        uint32_t sync_by = tx->tx_start + preamble_us(tx->frame_regs);
+        if ((int32_t)(sync_by - now - (uint32_t)(SIM_SYNC_SYMBOLS * symbol_us(tx->frame_regs))) < 0)
+        {
+            continue;
+        }
+        rx->rx_source = tx;
+        rx->collided = 0;
+        rx->rx_streaming = 0;
+        uint32_t header_end = sync_by + (uint32_t)(SIM_HEADER_SYMBOLS * symbol_us(tx->frame_regs));
+        schedule(SimRxHeader, rx, tx, header_end);
+        schedule(SimRxDone, rx, tx, tx->tx_end);
+        start_hopping(rx, tx, header_end);
+        return 1;
+    }
+    return 0;
+}
+
+static void write_opmode(SX1278Sim* radio, uint8_t value, uint32_t now)
+{
+    uint8_t previous = mode_of(radio);
+    uint8_t mode = value & MODE_MASK;
+
+    // The modem can only be switched between FSK and LoRa in Sleep
+    if (previous != Sleep)
+    {
+        value = (value & ~LONG_RANGE_MODE) | (radio->regs[REG_OPMODE] & LONG_RANGE_MODE);
+    }
+    radio->regs[REG_OPMODE] = value;
+    if (mode == previous || !(value & LONG_RANGE_MODE))
+    {
+        return;
+    }
+
+    if (radio->transmitting)
+    {
+        abort_transmission(radio);
+    }
+    cancel_events(radio);
+    radio->rx_source = NULL;
+    radio->rx_streaming = 0;
+
+    switch (mode)
+    {
+    case Tx:
+        start_tx(radio, now);
+        break;
+    case RxContinuous:
+        radio->rx_addr = radio->regs[REG_FIFO_RX_BASE_ADDR];
+        join_transmission(radio, now);
+        break;
+    case RxSingle:
+    {
+        radio->rx_addr = radio->regs[REG_FIFO_RX_BASE_ADDR];
+        if (join_transmission(radio, now))
+        {
+            break;
+        }
+        uint16_t symbols = ((radio->regs[REG_MODEM_CONFIG2] & 0b11) << 8) | radio->regs[REG_SYMB_TIMOUT_LSB];
+        schedule(SimRxTimeout, radio, NULL, now + (uint32_t)(symbols * symbol_us(radio->regs)));
+        break;
+    }
+    case Cad:
+        radio->cad_start = now;
+        schedule(SimCadDone, radio, NULL, now + (uint32_t)(SIM_CAD_SYMBOLS * symbol_us(radio->regs)));
+        break;
+    default:
+        break;
+    }
+}
+
+static uint8_t channel_busy(SX1278Sim* radio, uint32_t since)
+{
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        SX1278Sim* tx = &radios[i];
+        if (tx != radio && tx->used && tx->transmitting && same_channel(tx->frame_regs, radio->regs)
+            && (int32_t)(tx->tx_end - since) > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void deliver(SX1278Sim* radio, SX1278Sim* source)
+{
+    // In RxContinuous every frame is written right after the previous one
+    uint8_t start = radio->rx_addr;
+    uint8_t size = radio->regs[REG_MODEM_CONFIG1] & 1 ? radio->regs[REG_PAYLOAD_LENGTH] : source->frame_size;
+
+    for (uint16_t i = 0; i < size; i++)
+    {
+        radio->fifo[(uint8_t)(start + i)] = i < source->frame_size ? source->frame[i] : 0;
+    }
+    radio->regs[REG_FIFO_RX_CURRENT_ADDR] = start;
+    if (size > 0)
+    {
+        radio->regs[REG_FIFO_RX_BYTE_ADDR] = start + size - 1;
+    }
+    radio->rx_addr = start + size;
+    radio->regs[REG_RX_NB_BYTES] = size;
+    radio->regs[REG_PKT_SNR_VALUE] = SNR_PACKET;
+    radio->regs[REG_PKT_RSSI_VALUE] = RSSI_PACKET;
+    if (++radio->regs[REG_RX_PACKET_CNT_VALUE_LSB] == 0)
+    {
+        radio->regs[REG_RX_PACKET_CNT_VALUE_MSB]++;
+    }
+    radio->stats.frames_received++;
+    radio->rx_done_spi = radio->spi_bytes;
+    radio->reply_window = 1;
+    set_irq(radio, IRQ_RX_DONE);
+}
+
+static void process(SimEvent* event)
+{
+    SX1278Sim* radio = event->radio;
+    switch (event->type)
+    {
+    case SimTxDone:
+        check_hop(radio);
+        radio->transmitting = 0;
+        set_irq(radio, IRQ_TX_DONE);
+        enter_mode(radio, Standby);
+        break;
+    case SimRxHeader:
+        if (radio->collided)
+        {
+            break;
+        }
+        // An implicit header frame has nothing to validate, the payload simply follows the preamble
+        if (!(radio->regs[REG_MODEM_CONFIG1] & 1))
+        {
+            radio->regs[REG_HOP_CHANNEL] = (radio->regs[REG_HOP_CHANNEL] & HOP_CHANNEL_MASK)
+                | ((event->source->frame_regs[REG_MODEM_CONFIG2] & PAYLOAD_CRC_ON) ? HOP_CRC_ON_PAYLOAD : 0);
+            if (++radio->regs[REG_RX_HEADER_CNT_VALUE_LSB] == 0)
+            {
+                radio->regs[REG_RX_HEADER_CNT_VALUE_MSB]++;
+            }
+            set_irq(radio, IRQ_VALID_HEADER);
+        }
+        radio->rx_streaming = 1;
+        radio->rx_payload_start = event->due;
+        radio->rx_written = 0;
+        break;
+    case SimRxDone:
+        check_hop(radio);
+        radio->rx_source = NULL;
+        radio->rx_streaming = 0;
+        if (radio->collided)
+        {
+            radio->collided = 0;
+            break;
+        }
+        deliver(radio, event->source);
+        if (mode_of(radio) == RxSingle)
+        {
+            enter_mode(radio, Standby);
+        }
+        break;
+    case SimRxTimeout:
+        set_irq(radio, IRQ_RX_TIMEOUT);
+        enter_mode(radio, Standby);
+        break;
+    case SimCadDone:
+        set_irq(radio, IRQ_CAD_DONE | (channel_busy(radio, radio->cad_start) ? IRQ_CAD_DETECTED : 0));
+        enter_mode(radio, Standby);
+        break;
+    case SimHop:
+    {
+        SX1278Sim* tx = event->source != NULL ? event->source : radio;
+        uint32_t next = event->due + (uint32_t)(radio->regs[REG_HOP_PERIOD] * symbol_us(radio->regs));
+        check_hop(radio);
+        radio->hop_pending = 1;
+        radio->hop_frf = frf_of(radio->regs);
+        radio->regs[REG_HOP_CHANNEL] = (radio->regs[REG_HOP_CHANNEL] & ~HOP_CHANNEL_MASK)
+            | ((radio->regs[REG_HOP_CHANNEL] + 1) & HOP_CHANNEL_MASK);
+        radio->stats.hops++;
+        set_irq(radio, IRQ_FHSS_CHANGE_CHANNEL);
+        if ((int32_t)(tx->tx_end - next) > 0)
+        {
+            schedule(SimHop, radio, event->source, next);
+        }
+        break;
+    }
+    }
+}
+
+// Rising DIO edges are collected under the lock and dispatched after it is released
+static uint8_t collect_edges(SimEdge* edges, uint8_t count)
+{
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        SX1278Sim* radio = &radios[i];
+        if (!radio->used)
+        {
+            continue;
+        }
+        uint8_t levels = 0;
+        uint16_t mapping = (radio->regs[REG_DIO_MAPPING_1] << 8) | radio->regs[REG_DIO_MAPPING_2];
+        for (uint8_t dio = 0; dio < SX1278_DIO_COUNT; dio++)
+        {
+            uint8_t flag = dio_flags[dio][(mapping >> (14 - 2 * dio)) & 0b11];
+            if (!radio->in_reset && (radio->regs[REG_IRQ_FLAGS] & flag) != 0)
+            {
+                levels |= 1 << dio;
+            }
+        }
+        uint8_t rising = levels & ~radio->dio_levels;
+        radio->dio_levels = levels;
+        for (uint8_t dio = 0; dio < SX1278_DIO_COUNT && rising != 0; dio++)
+        {
+            int pin = radio->config.dio_pins[dio];
+            if (!(rising & (1 << dio)) || pin == SX1278_PIN_UNUSED)
+            {
+                continue;
+            }
+            for (uint8_t j = 0; j < SIM_MAX_ISRS; j++)
+            {
+                if (isrs[j].handler != NULL && isrs[j].pin == pin && count < SIM_MAX_ISRS)
+                {
+                    edges[count].handler = isrs[j].handler;
+                    edges[count].arg = isrs[j].arg;
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+static void dispatch_edges(SimEdge* edges, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+    {
+        edges[i].handler(edges[i].arg);
+    }
+}
+
+static SimEvent* next_event()
+{
+    SimEvent* next = NULL;
+    for (uint8_t i = 0; i < SIM_MAX_EVENTS; i++)
+    {
+        if (events[i].used && (next == NULL || (int32_t)(events[i].due - next->due) < 0))
+        {
+            next = &events[i];
+        }
+    }
+    return next;
+}
+
+static void* sim_main(void* arg)
+{
+    SimEdge edges[SIM_MAX_ISRS];
+    pthread_mutex_lock(&sim_lock);
+    while (1)
+    {
+        SimEvent* next = next_event();
+        if (next == NULL)
+        {
+            pthread_cond_wait(&sim_wake, &sim_lock);
+            continue;
+        }
+
+        int32_t remaining = next->due - SX1278_hal_time_us();
+        if (remaining > 0)
+        {
+            struct timespec deadline;
+            SX1278_hal_linux_deadline(remaining, &deadline);
+            pthread_cond_timedwait(&sim_wake, &sim_lock, &deadline);
+            continue;
+        }
+
+        // Everything due is applied before any ISR runs, so a TxDone handler
+        // never sees the receiving side of the same frame still in flight
+        uint32_t now = SX1278_hal_time_us();
+        while (next != NULL && (int32_t)(next->due - now) <= 0)
+        {
+            SimEvent event = *next;
+            next->used = 0;
+            process(&event);
+            next = next_event();
+        }
+        uint8_t count = collect_edges(edges, 0);
+        pthread_mutex_unlock(&sim_lock);
+        dispatch_edges(edges, count);
+        pthread_mutex_lock(&sim_lock);
+    }
+    return NULL;
+}
+
+static SX1278Sim* find_radio(int host, int cs_pin)
+{
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        if (radios[i].used && radios[i].config.spi_host == host && radios[i].config.cs_pin == cs_pin)
+        {
+            return &radios[i];
+        }
+    }
+    return NULL;
+}
+
+SX1278Sim* SX1278_sim_add(const SX1278Config* config)
+{
+    SX1278Sim* radio = NULL;
+    pthread_mutex_lock(&sim_lock);
+    if (!sim_started)
+    {
+        SX1278_hal_linux_cond_init(&sim_wake);
+        pthread_create(&sim_thread, NULL, sim_main, NULL);
+        pthread_detach(sim_thread);
+        sim_started = 1;
+    }
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        if (!radios[i].used)
+        {
+            radio = &radios[i];
+            memset(radio, 0, sizeof(SX1278Sim));
+            radio->used = 1;
+            radio->config = *config;
+            reset_registers(radio);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return radio;
+}
+
+void SX1278_sim_remove(SX1278Sim* radio)
+{
+    pthread_mutex_lock(&sim_lock);
+    abort_transmission(radio);
+    cancel_events(radio);
+    radio->used = 0;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void SX1278_sim_get_stats(SX1278Sim* radio, SX1278SimStats* stats)
+{
+    pthread_mutex_lock(&sim_lock);
+    *stats = radio->stats;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+uint8_t SX1278_sim_read_hops(SX1278Sim* radio, SX1278SimHop* hops, uint8_t max)
+{
+    pthread_mutex_lock(&sim_lock);
+    uint8_t count = radio->hop_log_count < max ? radio->hop_log_count : max;
+    memcpy(hops, radio->hop_log, count * sizeof(SX1278SimHop));
+    radio->hop_log_count = 0;
+    pthread_mutex_unlock(&sim_lock);
+    return count;
+}
+
+// Payload bytes reach the FIFO at an even pace between the header and the end of the frame
+static void fill_fifo(SX1278Sim* radio, uint32_t now)
+{
+    SX1278Sim* tx = radio->rx_source;
+    if (!radio->rx_streaming || tx == NULL || radio->collided)
+    {
+        return;
+    }
+    uint32_t span = tx->tx_end - radio->rx_payload_start;
+    uint32_t elapsed = now - radio->rx_payload_start;
+    uint8_t bytes = elapsed >= span ? tx->frame_size : (uint64_t)tx->frame_size * elapsed / span;
+    for (; radio->rx_written < bytes; radio->rx_written++)
+    {
+        radio->fifo[(uint8_t)(radio->rx_addr + radio->rx_written)] = tx->frame[radio->rx_written];
+    }
+    // The address of the last byte written, left alone until the first one arrives
+    if (bytes > 0)
+    {
+        radio->regs[REG_FIFO_RX_BYTE_ADDR] = radio->rx_addr + bytes - 1;
+    }
+}
+
+// 0x0d to 0x3f are separate registers in FSK mode, LoRa settings written there are lost
+static uint8_t is_fsk_page(SX1278Sim* radio, uint8_t addr)
+{
+    return addr >= SIM_FSK_PAGE_START && addr <= SIM_FSK_PAGE_END && !(radio->regs[REG_OPMODE] & LONG_RANGE_MODE);
+}
+
+static uint8_t read_register(SX1278Sim* radio, uint8_t addr)
+{
+    if (is_fsk_page(radio, addr))
+    {
+        return radio->fsk_regs[addr];
+    }
+    switch (addr)
+    {
+    case REG_FIFO_RX_BYTE_ADDR:
+        fill_fifo(radio, SX1278_hal_time_us());
+        return radio->regs[addr];
+    case REG_FIFO:
+        return radio->fifo[radio->regs[REG_FIFO_ADDR_PTR]++];
+    case REG_RSSI_VALUE:
+        return channel_busy(radio, SX1278_hal_time_us()) ? RSSI_PACKET : RSSI_NOISE_FLOOR;
+    case REG_HOP_CHANNEL:
+        radio->hop_channel_read = radio->regs[addr] & HOP_CHANNEL_MASK;
+        return radio->regs[addr];
+    default:
+        return radio->regs[addr];
+    }
+}
+
+static void write_register(SX1278Sim* radio, uint8_t addr, uint8_t data, uint32_t now)
+{
+    if (is_fsk_page(radio, addr))
+    {
+        radio->fsk_regs[addr] = data;
+        return;
+    }
+    switch (addr)
+    {
+    case REG_FIFO:
+        radio->fifo[radio->regs[REG_FIFO_ADDR_PTR]++] = data;
+        break;
+    case REG_OPMODE:
+        write_opmode(radio, data, now);
+        break;
+    case REG_IRQ_FLAGS:
+        radio->regs[REG_IRQ_FLAGS] &= ~data;
+        break;
+    case REG_FR_LSB:
+        // The last byte of the Frf burst, a hop answer is complete here
+        radio->regs[addr] = data;
+        if (radio->hop_pending && radio->hop_log_count < SIM_HOP_LOG)
+        {
+            SX1278SimHop* hop = &radio->hop_log[radio->hop_log_count++];
+            hop->channel = radio->hop_channel_read;
+            hop->frf = frf_of(radio->regs);
+        }
+        break;
+    case REG_FIFO_RX_CURRENT_ADDR:
+    case REG_RX_NB_BYTES:
+    case REG_RX_HEADER_CNT_VALUE_MSB:
+    case REG_RX_HEADER_CNT_VALUE_LSB:
+    case REG_RX_PACKET_CNT_VALUE_LSB:
+    case REG_RX_PACKET_CNT_VALUE_MSB:
+    case REG_MODEM_STAT:
+    case REG_PKT_SNR_VALUE:
+    case REG_PKT_RSSI_VALUE:
+    case REG_RSSI_VALUE:
+    case REG_HOP_CHANNEL:
+    case REG_FIFO_RX_BYTE_ADDR:
+    case REG_VERSION:
+        break;
+    default:
+        radio->regs[addr] = data;
+        break;
+    }
+}
+
+void SX1278_sim_spi_transfer(int host, int cs_pin, uint8_t cmd, const uint8_t* mosi, uint8_t* miso, uint8_t len)
+{
+    SimEdge edges[SIM_MAX_ISRS];
+    uint8_t count = 0;
+    uint8_t addr = cmd & 0x7f;
+
+    pthread_mutex_lock(&sim_lock);
+    SX1278Sim* radio = find_radio(host, cs_pin);
+    uint32_t now = SX1278_hal_time_us();
+    if (radio != NULL)
+    {
+        radio->spi_bytes += len + 1;
+    }
+    for (uint8_t i = 0; i < len; i++)
+    {
+        if (radio == NULL || radio->in_reset)
+        {
+            if (miso != NULL)
+            {
+                miso[i] = 0;
+            }
+            continue;
+        }
+        if (cmd & 0x80)
+        {
+            write_register(radio, addr, mosi[i], now);
+        }
+        else if (miso != NULL)
+        {
+            miso[i] = read_register(radio, addr);
+        }
+        // Burst access stays on the FIFO but walks through the registers
+        if (addr != REG_FIFO)
+        {
+            addr = (addr + 1) & 0x7f;
+        }
+    }
+    if (radio != NULL)
+    {
+        count = collect_edges(edges, 0);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    dispatch_edges(edges, count);
+}
+
+void SX1278_sim_gpio_set_level(int pin, uint32_t level)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (uint8_t i = 0; i < SX1278_SIM_MAX_RADIOS; i++)
+    {
+        SX1278Sim* radio = &radios[i];
+        if (!radio->used || radio->config.reset_pin != pin)
+        {
+            continue;
+        }
+        if (level == 0 && !radio->in_reset)
+        {
+            abort_transmission(radio);
+            cancel_events(radio);
+            reset_registers(radio);
+        }
+        radio->in_reset = level == 0;
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void SX1278_sim_attach_isr(int pin, SX1278IsrHandler handler, void* arg)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (uint8_t i = 0; i < SIM_MAX_ISRS; i++)
+    {
+        if (isrs[i].handler != NULL && isrs[i].pin == pin)
+        {
+            isrs[i].handler = NULL;
+        }
+    }
+    for (uint8_t i = 0; handler != NULL && i < SIM_MAX_ISRS; i++)
+    {
+        if (isrs[i].handler == NULL)
+        {
+            isrs[i] = (SimIsr){ .pin = pin, .handler = handler, .arg = arg };
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
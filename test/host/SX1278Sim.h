@@ -0,0 +1,41 @@
+#ifndef SX1278SIM_H
+#define SX1278SIM_H
+
+#include "SX1278.h"
+
+#define SX1278_SIM_MAX_RADIOS       4
+
+typedef struct SX1278Sim_struct SX1278Sim;
+
+typedef struct SX1278SimStats_struct
+{
+    uint32_t frames_sent;
+    uint32_t frames_received;
+    uint32_t collisions;
+    uint32_t airtime_us;
+    uint32_t hops;
+    uint32_t missed_hops;
+    // SPI bytes the host moved between the last RxDone and the TX start that followed it
+    uint32_t reply_spi_bytes;
+} SX1278SimStats;
+
+// A frequency the host programmed in answer to FhssChangeChannel, with the channel it had read
+typedef struct SX1278SimHop_struct
+{
+    uint8_t channel;
+    uint32_t frf;
+} SX1278SimHop;
+
+// A simulated chip answers on the SPI host/CS and GPIO pins of the given config
+SX1278Sim* SX1278_sim_add(const SX1278Config* config);
+void SX1278_sim_remove(SX1278Sim* radio);
+void SX1278_sim_get_stats(SX1278Sim* radio, SX1278SimStats* stats);
+// Copies out the hops logged since the last call and clears the log
+uint8_t SX1278_sim_read_hops(SX1278Sim* radio, SX1278SimHop* hops, uint8_t max);
+
+void SX1278_sim_spi_transfer(int host, int cs_pin, uint8_t cmd, const uint8_t* mosi, uint8_t* miso, uint8_t len);
+void SX1278_sim_gpio_set_level(int pin, uint32_t level);
+void SX1278_sim_attach_isr(int pin, SX1278IsrHandler handler, void* arg);
+
+
+#endif //SX1278SIM_H
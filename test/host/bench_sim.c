@@ -0,0 +1,169 @@
+#include "test_common.h"
+#include "SX1278HalLinux.h"
+#include "string.h"
+
+#define BENCH_PACKETS           8
+#define BENCH_BURST             SX1278_TX_QUEUE_LENGTH
+#define BENCH_PAYLOAD_SIZE      16
+#define BENCH_TARGET_TOA_US     20000
+#define BENCH_WAIT_MS           600000
+
+typedef struct BenchResult_struct
+{
+    uint32_t toa_us;
+    uint32_t scale;
+    double packets_per_s;
+    double tx_latency_us;
+    double tx_overhead_us;
+    double rx_notify_us;
+    double spi_transactions;
+    double spi_bytes;
+    double cpu_us;
+    uint32_t received;
+} BenchResult;
+
+static SX1278* sender;
+static SX1278* receiver;
+static SX1278Task bench_task;
+static volatile uint32_t rx_count;
+static volatile uint64_t rx_notify_sum;
+
+
+// Stands in for the application: drains the ring as soon as RxDone is signalled
+static void rx_consumer(void* arg)
+{
+    while (1)
+    {
+        SX1278_hal_task_wait(0, SX1278_WAIT_FOREVER);
+        uint32_t now = SX1278_hal_time_us();
+        PacketBuffer* packet;
+        while ((packet = SX1278_rx_peek(receiver)) != NULL)
+        {
+            rx_notify_sum += now - packet->status.timestamp;
+            SX1278_rx_release(receiver);
+            rx_count++;
+            SX1278_hal_task_notify(bench_task);
+        }
+    }
+}
+
+static uint64_t driver_cpu_ns()
+{
+    return SX1278_hal_linux_task_cpu_ns(sender->worker_task) + SX1278_hal_linux_task_cpu_ns(receiver->worker_task);
+}
+
+static void wait_mode(SX1278* dev, OperationMode mode)
+{
+    while (dev->mode != mode)
+    {
+        SX1278_hal_delay_us(100 * SX1278_hal_linux_time_scale());
+    }
+}
+
+static void run(SpreadingFactor sf, Bandwidth bw, BenchResult* result)
+{
+    uint8_t payload[BENCH_PAYLOAD_SIZE];
+    SpiStats tx_spi, rx_spi;
+    memset(result, 0, sizeof(BenchResult));
+    memset(payload, 0xa5, sizeof(payload));
+
+    settings.modem_config1.bits.bandwidth = bw;
+    settings.modem_config2.bits.spreading_factor = sf;
+    SX1278_reconfigure(sender, &settings);
+    SX1278_reconfigure(receiver, &settings);
+
+    // Slow configurations run on a faster simulated clock to keep the suite short
+    result->toa_us = SX1278_get_toa_us(sender, sizeof(payload));
+    result->scale = result->toa_us > BENCH_TARGET_TOA_US ? result->toa_us / BENCH_TARGET_TOA_US : 1;
+    SX1278_hal_linux_set_time_scale(result->scale);
+
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+    wait_mode(receiver, RxContinuous);
+    SX1278_hal_task_wait(1, 0);
+    rx_count = 0;
+    rx_notify_sum = 0;
+    SX1278_reset_spi_stats(sender);
+    SX1278_reset_spi_stats(receiver);
+    uint64_t cpu = driver_cpu_ns();
+
+    // One frame at a time: enqueue to TxDone, and RxDone to the consumer waking up
+    uint64_t tx_latency = 0;
+    for (uint32_t i = 0; i < BENCH_PACKETS; i++)
+    {
+        uint32_t start = SX1278_hal_time_us();
+        SX1278_enqueue_tx(sender, payload, sizeof(payload), SX1278_WAIT_FOREVER);
+        SX1278_hal_task_wait(0, BENCH_WAIT_MS);
+        tx_latency += SX1278_hal_time_us() - start;
+        SX1278_hal_task_wait(0, BENCH_WAIT_MS);
+    }
+
+    // Back to back through the TX queue
+    uint32_t start = SX1278_hal_time_us();
+    for (uint32_t i = 0; i < BENCH_BURST; i++)
+    {
+        SX1278_enqueue_tx(sender, payload, sizeof(payload), SX1278_WAIT_FOREVER);
+    }
+    for (uint32_t i = 0; i < 2 * BENCH_BURST; i++)
+    {
+        SX1278_hal_task_wait(0, BENCH_WAIT_MS);
+    }
+    uint32_t elapsed = SX1278_hal_time_us() - start;
+
+    uint32_t packets = BENCH_PACKETS + BENCH_BURST;
+    SX1278_get_spi_stats(sender, &tx_spi);
+    SX1278_get_spi_stats(receiver, &rx_spi);
+    result->received = rx_count;
+    result->packets_per_s = elapsed > 0 ? BENCH_BURST * 1e6 / elapsed : 0;
+    result->tx_latency_us = (double)tx_latency / BENCH_PACKETS;
+    // Driver and scheduling overhead is reported in host time, independent of the scale
+    result->tx_overhead_us = (result->tx_latency_us - result->toa_us) / result->scale;
+    result->rx_notify_us = rx_count > 0 ? (double)rx_notify_sum / rx_count / result->scale : 0;
+    result->spi_transactions = (double)(tx_spi.transactions + rx_spi.transactions) / packets;
+    result->spi_bytes = (double)(tx_spi.bytes + rx_spi.bytes) / packets;
+    result->cpu_us = (driver_cpu_ns() - cpu) / 1000.0 / packets;
+
+    SX1278_switch_mode(receiver, Standby);
+    wait_mode(receiver, Standby);
+    SX1278_hal_linux_set_time_scale(1);
+}
+
+int main(int argc, char** argv)
+{
+    FILE* out = argc > 1 ? fopen(argv[1], "w") : stdout;
+    if (out == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    sender = create_radio(NULL, 10, 11, 12, 13, SX1278_PIN_UNUSED);
+    receiver = create_radio(NULL, 20, 21, 22, 23, SX1278_PIN_UNUSED);
+    bench_task = SX1278_hal_task_self();
+    sender->tx_done_handle = bench_task;
+    receiver->rx_done_handle = SX1278_hal_task_create(rx_consumer, "rx", 0, NULL, 0);
+
+    int lost = 0;
+    for (int sf = SF7; sf <= SF12; sf++)
+    {
+        for (int bw = Bw7_8kHz; bw <= Bw500kHz; bw++)
+        {
+            BenchResult r;
+            run(sf, bw, &r);
+            lost += r.received != BENCH_PACKETS + BENCH_BURST;
+            fprintf(out, "{\"sf\": %d, \"bw_hz\": %u, \"payload\": %d, \"toa_us\": %u, \"time_scale\": %u, "
+                "\"packets_per_s\": %.3f, \"tx_latency_us\": %.1f, \"tx_overhead_us\": %.1f, \"rx_notify_us\": %.1f, "
+                "\"spi_transactions_per_packet\": %.2f, \"spi_bytes_per_packet\": %.1f, \"cpu_us_per_packet\": %.1f, "
+                "\"received\": %u}\n",
+                sf, SX1278_bandwidth_hz(bw), BENCH_PAYLOAD_SIZE, r.toa_us, r.scale,
+                r.packets_per_s, r.tx_latency_us, r.tx_overhead_us, r.rx_notify_us,
+                r.spi_transactions, r.spi_bytes, r.cpu_us, r.received);
+            fflush(out);
+        }
+    }
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return lost != 0;
+}
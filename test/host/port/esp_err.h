@@ -0,0 +1,31 @@
+#ifndef ESP_ERR_H
+#define ESP_ERR_H
+
+#include "stdio.h"
+#include "stdlib.h"
+
+typedef int esp_err_t;
+
+#define ESP_OK      0
+#define ESP_FAIL    -1
+
+#define ESP_ERROR_CHECK(x) do {                                             \
+    esp_err_t err_rc_ = (x);                                                \
+    if (err_rc_ != ESP_OK)                                                  \
+    {                                                                       \
+        fprintf(stderr, "ESP_ERROR_CHECK failed: %s:%d\n", __FILE__, __LINE__); \
+        abort();                                                            \
+    }                                                                       \
+} while (0)
+
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) ({                                 \
+    esp_err_t err_rc_ = (x);                                                \
+    if (err_rc_ != ESP_OK)                                                  \
+    {                                                                       \
+        fprintf(stderr, "ESP_ERROR_CHECK failed: %s:%d\n", __FILE__, __LINE__); \
+    }                                                                       \
+    err_rc_;                                                                \
+})
+
+
+#endif //ESP_ERR_H
@@ -0,0 +1,14 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include "stdio.h"
+
+// Host build: errors and warnings go to stderr, the rest is type-checked and dropped
+#define ESP_LOGE(tag, format, ...)  fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  do { if (0) printf(format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, format, ...)  do { if (0) printf(format, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, format, ...)  do { if (0) printf(format, ##__VA_ARGS__); } while (0)
+
+
+#endif //ESP_LOG_H
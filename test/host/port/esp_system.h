@@ -0,0 +1,7 @@
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+
+#include "esp_err.h"
+
+
+#endif //ESP_SYSTEM_H
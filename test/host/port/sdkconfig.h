@@ -0,0 +1,7 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// Host build: options come from target_compile_definitions instead
+
+
+#endif //SDKCONFIG_H
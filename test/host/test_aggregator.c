@@ -0,0 +1,146 @@
+#include "test_common.h"
+#include "SX1278Aggregator.h"
+#include "SX1278HalLinux.h"
+#include "string.h"
+
+#define WAIT_MS     2000
+#define MESSAGE     8
+
+static SX1278* sender;
+static SX1278* receiver;
+static uint8_t next_id = 0;
+
+
+static void send_messages(SX1278Aggregator* aggregator, uint8_t count, uint32_t deadline_ms)
+{
+    uint8_t message[MESSAGE];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        memset(message, next_id++, sizeof(message));
+        CHECK(SX1278_aggregator_send(aggregator, message, sizeof(message), deadline_ms, WAIT_MS));
+    }
+}
+
+// Unpacks every frame that reaches the receiver and checks the messages arrive in order
+static uint32_t receive_messages(uint8_t* expected_id, uint32_t* frames)
+{
+    PacketBuffer* packet;
+    uint32_t messages = 0;
+    while (SX1278_hal_task_wait(1, WAIT_MS) > 0)
+    {
+        while ((packet = SX1278_rx_take(receiver)) != NULL)
+        {
+            uint8_t offset = 0;
+            const uint8_t* data;
+            uint8_t len;
+            while (SX1278_aggregator_next(packet->payload, packet->status.size, &offset, &data, &len))
+            {
+                CHECK(len == MESSAGE);
+                CHECK(data[0] == *expected_id && data[MESSAGE - 1] == *expected_id);
+                (*expected_id)++;
+                messages++;
+            }
+            CHECK(offset == packet->status.size);
+            SX1278_pool_free(packet);
+            (*frames)++;
+        }
+    }
+    return messages;
+}
+
+static void test_deadline()
+{
+    SX1278AggregatorStats stats;
+    uint8_t expected_id = next_id;
+    uint32_t frames = 0;
+    SX1278Aggregator* aggregator = SX1278_aggregator_create(sender, SX1278_AGGREGATOR_MAX_FRAME);
+    CHECK(aggregator != NULL);
+
+    // Twenty messages fit in one frame, the first deadline sends them together
+    send_messages(aggregator, 20, 100);
+    CHECK(receive_messages(&expected_id, &frames) == 20);
+    CHECK(frames == 1);
+    SX1278_aggregator_get_stats(aggregator, &stats);
+    CHECK(stats.messages == 20 && stats.frames == 1);
+    CHECK(stats.flush_deadline == 1 && stats.flush_full == 0);
+    CHECK(stats.airtime_us == SX1278_get_toa_us(sender, 20 * (MESSAGE + 1)));
+    CHECK(stats.airtime_saved_us == 20 * SX1278_get_toa_us(sender, MESSAGE) - stats.airtime_us);
+
+    // A deadline past the signed microsecond range would wrap around and flush at once
+    uint8_t message[MESSAGE] = {0};
+    CHECK(!SX1278_aggregator_send(aggregator, message, sizeof(message), SX1278_AGGREGATOR_MAX_DEADLINE_MS + 1, WAIT_MS));
+    send_messages(aggregator, 1, SX1278_AGGREGATOR_MAX_DEADLINE_MS);
+    CHECK(receive_messages(&expected_id, &frames) == 0);
+    SX1278_aggregator_flush(aggregator);
+    CHECK(receive_messages(&expected_id, &frames) == 1);
+    SX1278_aggregator_destroy(aggregator);
+}
+
+static void test_full()
+{
+    SX1278AggregatorStats stats;
+    uint8_t expected_id = next_id;
+    uint32_t frames = 0;
+    SX1278Aggregator* aggregator = SX1278_aggregator_create(sender, SX1278_AGGREGATOR_MAX_FRAME);
+    CHECK(aggregator != NULL);
+
+    // 28 records of 9 bytes fill a frame, the rest goes out on the explicit flush
+    send_messages(aggregator, 40, 60000);
+    SX1278_aggregator_flush(aggregator);
+    CHECK(receive_messages(&expected_id, &frames) == 40);
+    CHECK(frames == 2);
+    SX1278_aggregator_get_stats(aggregator, &stats);
+    CHECK(stats.messages == 40 && stats.frames == 2);
+    CHECK(stats.flush_full == 1 && stats.flush_deadline == 0);
+    CHECK(stats.dropped == 0);
+    CHECK(stats.airtime_saved_us > stats.airtime_us);
+    SX1278_aggregator_destroy(aggregator);
+}
+
+static void test_destroy()
+{
+    uint8_t expected_id = next_id;
+    uint32_t frames = 0;
+    SX1278Aggregator* aggregator = SX1278_aggregator_create(sender, SX1278_AGGREGATOR_MAX_FRAME);
+    CHECK(aggregator != NULL);
+
+    // No deadline is due yet, destroy itself has to send what is still queued
+    send_messages(aggregator, 40, 60000);
+    SX1278_aggregator_destroy(aggregator);
+    CHECK(receive_messages(&expected_id, &frames) == 40);
+    CHECK(frames == 2);
+}
+
+static void test_next()
+{
+    const uint8_t frame[] = { 2, 'a', 'b', 1, 'c', 0, 0, 0 };
+    const uint8_t truncated[] = { 2, 'a', 'b', 4, 'c' };
+    uint8_t offset = 0;
+    const uint8_t* data;
+    uint8_t len;
+    CHECK(SX1278_aggregator_next(frame, sizeof(frame), &offset, &data, &len) && len == 2 && data[1] == 'b');
+    CHECK(SX1278_aggregator_next(frame, sizeof(frame), &offset, &data, &len) && len == 1 && data[0] == 'c');
+    // Zero padding ends the records
+    CHECK(!SX1278_aggregator_next(frame, sizeof(frame), &offset, &data, &len));
+
+    offset = 0;
+    CHECK(SX1278_aggregator_next(truncated, sizeof(truncated), &offset, &data, &len));
+    CHECK(!SX1278_aggregator_next(truncated, sizeof(truncated), &offset, &data, &len));
+}
+
+int main()
+{
+    sender = create_radio(NULL, 10, 11, 12, 13, SX1278_PIN_UNUSED);
+    receiver = create_radio(NULL, 20, 21, 22, 23, SX1278_PIN_UNUSED);
+    CHECK(sender != NULL && receiver != NULL);
+    receiver->rx_done_handle = SX1278_hal_task_self();
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+
+    test_next();
+    test_deadline();
+    test_full();
+    test_destroy();
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
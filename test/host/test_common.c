@@ -0,0 +1,32 @@
+#include "test_common.h"
+
+SX1278Settings settings = {
+    .channel_freq = DEFAULT_SX1278_FREQUENCY,
+    .pa_config.val = DEFAULT_PA_CONFIG,
+    .preamble_len = DEFAULT_PREAMBLE_LENGTH,
+    .modem_config1.val = DEFAULT_MODEM_CONFIG1,
+    .modem_config2.val = DEFAULT_MODEM_CONFIG2,
+    .sync_word = DEFAULT_SYNC_WORD,
+    .invert_iq.val = DEFAULT_NORMAL_IQ,
+};
+int failures = 0;
+
+
+SX1278* create_radio(SX1278Sim** radio, int cs_pin, int reset_pin, int dio0_pin, int dio1_pin, int dio3_pin)
+{
+    SX1278Config config = SX1278_DEFAULT_CONFIG();
+    config.cs_pin = cs_pin;
+    config.reset_pin = reset_pin;
+    config.dio_pins[0] = dio0_pin;
+    config.dio_pins[1] = dio1_pin;
+    config.dio_pins[3] = dio3_pin;
+    SX1278Sim* sim = SX1278_sim_add(&config);
+    if (radio != NULL)
+    {
+        *radio = sim;
+    }
+
+    SX1278* dev = SX1278_create(&config);
+    SX1278_initialize(dev, &settings);
+    return dev;
+}
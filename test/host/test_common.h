@@ -0,0 +1,24 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include "SX1278.h"
+#include "SX1278Sim.h"
+#include "stdio.h"
+
+#define CHECK(cond) do {                                                    \
+    if (!(cond))                                                            \
+    {                                                                       \
+        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);                   \
+        failures++;                                                         \
+    }                                                                       \
+} while (0)
+
+// Profile every host test starts from, a test may adjust it before creating radios
+extern SX1278Settings settings;
+extern int failures;
+
+// Adds a simulated chip on the given pins and brings the driver up on it, radio may be NULL
+SX1278* create_radio(SX1278Sim** radio, int cs_pin, int reset_pin, int dio0_pin, int dio1_pin, int dio3_pin);
+
+
+#endif //TEST_COMMON_H
@@ -0,0 +1,97 @@
+#include "test_common.h"
+#include "SX1278Gateway.h"
+#include "SX1278HalLinux.h"
+#include "string.h"
+
+#define WAIT_MS     2000
+#define FRAMES      6
+
+static SX1278ListenTarget targets[] = {
+    { .frf = 0x6c4000, .sf = SF7, .bw = Bw125kHz },
+    { .frf = 0x6cc000, .sf = SF8, .bw = Bw125kHz },
+};
+static SX1278* sender;
+static SX1278* radios[2];
+
+
+static void send_on(uint8_t target)
+{
+    SX1278Settings profile = settings;
+    uint8_t payload[] = { target, 'g', 'w' };
+    profile.channel_freq = targets[target].frf;
+    profile.modem_config1.bits.bandwidth = targets[target].bw;
+    profile.modem_config2.bits.spreading_factor = targets[target].sf;
+    SX1278_reconfigure(sender, &profile);
+    CHECK(SX1278_transmit(sender, payload, sizeof(payload), SX1278_WAIT_FOREVER));
+    CHECK(SX1278_hal_task_wait(1, WAIT_MS) > 0);
+}
+
+// Every frame has to come out of the shared queue tagged with the target it was sent on
+static uint32_t run(SX1278Gateway* gateway)
+{
+    SX1278Uplink uplink;
+    uint32_t captured = 0;
+    for (uint8_t i = 0; i < FRAMES; i++)
+    {
+        uint8_t target = i % 2;
+        SX1278_hal_delay_ms(20 + 13 * i);
+        send_on(target);
+        if (SX1278_gateway_receive(gateway, &uplink, WAIT_MS))
+        {
+            CHECK(uplink.packet->payload[0] == target);
+            CHECK(uplink.target_index == target);
+            CHECK(uplink.target.sf == targets[target].sf);
+            SX1278_gateway_release(&uplink);
+            captured++;
+        }
+    }
+    return captured;
+}
+
+static void test_rotating()
+{
+    SX1278GatewayStats stats;
+    SX1278Gateway* gateway = SX1278_gateway_create(radios, 1, targets, 2, &settings);
+    CHECK(gateway != NULL);
+    CHECK(SX1278_gateway_target_radio(gateway, 0) == SX1278_GATEWAY_ROTATING);
+
+    CHECK(run(gateway) == FRAMES);
+    SX1278_gateway_get_stats(gateway, &stats);
+    CHECK(stats.received == FRAMES);
+    CHECK(stats.per_target[0] == FRAMES / 2 && stats.per_target[1] == FRAMES / 2);
+    CHECK(stats.cad_detected >= FRAMES);
+    CHECK(stats.cad_runs > stats.cad_detected);
+    SX1278_gateway_destroy(gateway);
+}
+
+static void test_dedicated()
+{
+    SX1278GatewayStats stats;
+    SX1278Gateway* gateway = SX1278_gateway_create(radios, 2, targets, 2, &settings);
+    CHECK(gateway != NULL);
+    CHECK(SX1278_gateway_target_radio(gateway, 0) == 0);
+    CHECK(SX1278_gateway_target_radio(gateway, 1) == 1);
+
+    CHECK(run(gateway) == FRAMES);
+    SX1278_gateway_get_stats(gateway, &stats);
+    CHECK(stats.received == FRAMES);
+    CHECK(stats.cad_runs == 0);
+    SX1278_gateway_destroy(gateway);
+}
+
+int main()
+{
+    // Rotating radios have to catch a preamble after one full rotation
+    settings.preamble_len = 32;
+    sender = create_radio(NULL, 10, 11, 12, 13, SX1278_PIN_UNUSED);
+    radios[0] = create_radio(NULL, 20, 21, 22, 23, SX1278_PIN_UNUSED);
+    radios[1] = create_radio(NULL, 30, 31, 32, 33, SX1278_PIN_UNUSED);
+    CHECK(sender != NULL && radios[0] != NULL && radios[1] != NULL);
+    sender->tx_done_handle = SX1278_hal_task_self();
+
+    test_rotating();
+    test_dedicated();
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,715 @@
+#include "test_common.h"
+#include "SX1278HalLinux.h"
+#include "string.h"
+
+#define WAIT_MS     2000
+
+static const uint8_t expected[] = {'s', 'x', '1', '2', '7', '8'};
+static SX1278* sender;
+static SX1278* receiver;
+static SX1278Sim* sender_radio;
+static SX1278Sim* receiver_radio;
+
+
+// Commands run on the driver worker, so give it time to put the radio in RX
+static void wait_mode(SX1278* dev, OperationMode mode)
+{
+    for (uint32_t i = 0; i < WAIT_MS && dev->mode != mode; i++)
+    {
+        SX1278_hal_delay_ms(1);
+    }
+    CHECK(dev->mode == mode);
+}
+
+static void test_initialize()
+{
+    // The settings have to land in the LoRa registers, not in the FSK page
+    CHECK(SX1278_verify_shadow(sender) == 0);
+    CHECK(SX1278_verify_shadow(receiver) == 0);
+    CHECK(sender->shadow[REG_OPMODE] == (0x80 | Sleep));
+    CHECK(sender->shadow[REG_SYNC_WORD] == DEFAULT_SYNC_WORD);
+}
+
+static void test_ping()
+{
+    SX1278Task self = SX1278_hal_task_self();
+    sender->tx_done_handle = self;
+    receiver->rx_done_handle = self;
+
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+    wait_mode(receiver, RxContinuous);
+    uint32_t start = SX1278_hal_time_us();
+    CHECK(SX1278_transmit(sender, expected, sizeof(expected), SX1278_WAIT_FOREVER));
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+
+    PacketBuffer* packet = SX1278_rx_peek(receiver);
+    CHECK(packet != NULL);
+    if (packet != NULL)
+    {
+        CHECK(packet->status.size == sizeof(expected));
+        CHECK(memcmp(packet->payload, expected, sizeof(expected)) == 0);
+        CHECK(packet->status.timestamp - start >= SX1278_get_toa_us(sender, sizeof(expected)));
+        SX1278_rx_release(receiver);
+    }
+    SX1278_switch_mode(receiver, Standby);
+    SX1278_hal_task_wait(1, WAIT_MS);
+}
+
+static void test_tx_queue()
+{
+    SX1278Task self = SX1278_hal_task_self();
+    SX1278SimStats stats;
+    sender->tx_done_handle = self;
+    receiver->rx_done_handle = self;
+
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+    wait_mode(receiver, RxContinuous);
+    uint32_t start = SX1278_hal_time_us();
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        CHECK(SX1278_enqueue_tx(sender, expected, sizeof(expected), SX1278_WAIT_FOREVER));
+    }
+    // Three TxDone and three RxDone
+    for (uint8_t i = 0; i < 6; i++)
+    {
+        CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    }
+    uint32_t elapsed = SX1278_hal_time_us() - start;
+
+    // Frames leave back to back, so the burst takes about three times one frame
+    CHECK(elapsed >= 3 * SX1278_get_toa_us(sender, sizeof(expected)));
+    CHECK(elapsed < 4 * SX1278_get_toa_us(sender, sizeof(expected)));
+    SX1278_sim_get_stats(receiver_radio, &stats);
+    CHECK(stats.collisions == 0);
+
+    uint8_t payload[MAX_FIFO_BUFFER];
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        CHECK(SX1278_get_fifo(receiver, payload) == sizeof(expected));
+    }
+    CHECK(SX1278_rx_available(receiver) == 0);
+    SX1278_switch_mode(receiver, Standby);
+    SX1278_hal_task_wait(1, WAIT_MS);
+}
+
+static void test_rx_timeout()
+{
+    uint8_t buffer[MAX_FIFO_BUFFER];
+    receiver->rx_done_handle = SX1278_hal_task_self();
+
+    SX1278_receive_into(receiver, buffer, ExplicitHeaderMode);
+    CHECK(SX1278_hal_task_wait(1, WAIT_MS) > 0);
+    CHECK(receiver->mode == Standby);
+    CHECK(SX1278_rx_available(receiver) == 0);
+    CHECK(receiver->stats.rx_timeouts == 1);
+}
+
+static void test_cad()
+{
+    uint8_t payload[MAX_FIFO_BUFFER] = {0};
+    SX1278Task self = SX1278_hal_task_self();
+    sender->tx_done_handle = self;
+    receiver->cad_done_handle = self;
+
+    CHECK(SX1278_transmit(sender, payload, sizeof(payload) - 1, SX1278_WAIT_FOREVER));
+    SX1278_hal_delay_ms(5);
+    SX1278_start_cad(receiver);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(receiver->cad_detected);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+
+    SX1278_start_cad(receiver);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(!receiver->cad_detected);
+}
+
+static void test_lbt()
+{
+    uint8_t payload[MAX_FIFO_BUFFER] = {0};
+    SX1278Lbt lbt = SX1278_LBT_DEFAULT();
+    SX1278Stats stats;
+    SX1278Task self = SX1278_hal_task_self();
+    sender->tx_done_handle = self;
+    receiver->tx_done_handle = self;
+    SX1278_reset_stats(receiver);
+    SX1278_set_lbt(receiver, &lbt);
+
+    uint32_t start = SX1278_hal_time_us();
+    CHECK(SX1278_transmit(sender, payload, sizeof(payload) - 1, SX1278_WAIT_FOREVER));
+    SX1278_hal_delay_ms(5);
+    // The second radio has to wait until the long frame is off the air
+    CHECK(SX1278_enqueue_tx(receiver, expected, sizeof(expected), SX1278_WAIT_FOREVER));
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    uint32_t elapsed = SX1278_hal_time_us() - start;
+
+    SX1278_get_stats(receiver, &stats);
+    CHECK(stats.cad_busy >= 1);
+    CHECK(stats.lbt_backoffs == stats.cad_busy);
+    CHECK(stats.cad_runs == stats.cad_busy + 1);
+    CHECK(stats.lbt_dropped == 0);
+    CHECK(stats.tx_packets == 1);
+    CHECK(elapsed >= SX1278_get_toa_us(sender, sizeof(payload) - 1) + SX1278_get_toa_us(receiver, sizeof(expected)));
+
+    lbt.enabled = 0;
+    SX1278_set_lbt(receiver, &lbt);
+}
+
+static void test_sniff()
+{
+    uint8_t payload[MAX_FIFO_BUFFER];
+    SX1278Settings profile = settings;
+    SX1278Stats stats;
+    SX1278Op rx;
+    SX1278Task self = SX1278_hal_task_self();
+    sender->tx_done_handle = self;
+    receiver->rx_done_handle = NULL;
+
+    // Sniffing only pays off with a preamble much longer than one CAD
+    profile.preamble_len = 64;
+    SX1278_reconfigure(sender, &profile);
+    SX1278_reconfigure(receiver, &profile);
+    CHECK(SX1278_get_sniff_interval_us(receiver) == 58 * 1024);
+    SX1278_reset_stats(receiver);
+
+    // Sniffing started from a continuous receiver ends its receive and drops to the duty cycle
+    SX1278_op_init(&rx, NULL, NULL);
+    SX1278_receive_async(receiver, RxContinuous, ExplicitHeaderMode, payload, &rx);
+    wait_mode(receiver, RxContinuous);
+    SX1278_start_sniff(receiver, ExplicitHeaderMode);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpAborted);
+    SX1278_hal_delay_ms(200);
+    SX1278_get_stats(receiver, &stats);
+    CHECK(stats.cad_runs > 0);
+    receiver->rx_done_handle = self;
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        SX1278_hal_delay_ms(50 + 37 * i);
+        CHECK(SX1278_transmit(sender, expected, sizeof(expected), SX1278_WAIT_FOREVER));
+        CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+        CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+        CHECK(SX1278_get_fifo(receiver, payload) == sizeof(expected));
+    }
+    SX1278_hal_delay_ms(200);
+    SX1278_get_stats(receiver, &stats);
+    SX1278_switch_mode(receiver, Standby);
+    wait_mode(receiver, Standby);
+
+    CHECK(stats.rx_packets == 5);
+    CHECK(stats.sniff_detected == 5);
+    CHECK(stats.sniff_missed == 0);
+    // Idle listening costs one CAD per interval, the rest of the time the radio sleeps
+    uint32_t awake = stats.mode_dwell_us[Cad] + stats.mode_dwell_us[RxSingle] + stats.mode_dwell_us[Standby];
+    CHECK(stats.mode_dwell_us[Sleep] > awake);
+    CHECK(stats.mode_dwell_us[Sleep] > 10 * stats.mode_dwell_us[Cad]);
+    CHECK(receiver->shadow[REG_SYMB_TIMOUT_LSB] == 0x64);
+
+    SX1278_reconfigure(sender, &settings);
+    SX1278_reconfigure(receiver, &settings);
+}
+
+static void check_hops(SX1278Sim* radio, const uint32_t* table, uint8_t count)
+{
+    SX1278SimHop hops[32];
+    uint8_t logged = SX1278_sim_read_hops(radio, hops, 32);
+    CHECK(logged > 0);
+    for (uint8_t i = 0; i < logged; i++)
+    {
+        CHECK(hops[i].frf == table[hops[i].channel % count]);
+        CHECK(i == 0 || hops[i].channel > hops[i - 1].channel);
+    }
+}
+
+static void test_fhss()
+{
+    const uint32_t table[] = { 0x6c4000, 0x6c8000, 0x6cc000, 0x6d0000 };
+    uint8_t payload[MAX_FIFO_BUFFER] = {0};
+    uint8_t received[MAX_FIFO_BUFFER];
+    SX1278SimStats tx_sim, rx_sim;
+    SX1278SimHop hops[32];
+    SX1278Task self = SX1278_hal_task_self();
+    sender->tx_done_handle = self;
+    receiver->rx_done_handle = self;
+    for (uint8_t i = 0; i < sizeof(payload) - 1; i++)
+    {
+        payload[i] = i;
+    }
+
+    SX1278_reset_stats(sender);
+    SX1278_sim_get_stats(sender_radio, &tx_sim);
+    SX1278_sim_get_stats(receiver_radio, &rx_sim);
+    uint32_t tx_hops = tx_sim.hops, rx_hops = rx_sim.hops;
+    CHECK(SX1278_set_hop_table(sender, table, 4, 10));
+    CHECK(SX1278_set_hop_table(receiver, table, 4, 10));
+    SX1278_sim_read_hops(sender_radio, hops, 32);
+    SX1278_sim_read_hops(receiver_radio, hops, 32);
+
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+    wait_mode(receiver, RxContinuous);
+    CHECK(SX1278_transmit(sender, payload, sizeof(payload) - 1, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(SX1278_get_fifo(receiver, received) == sizeof(payload) - 1);
+    CHECK(memcmp(received, payload, sizeof(payload) - 1) == 0);
+    SX1278_switch_mode(receiver, Standby);
+    SX1278_hal_task_wait(1, WAIT_MS);
+
+    // The hop count follows from the simulated air time, the answers have to follow the table
+    SX1278_sim_get_stats(sender_radio, &tx_sim);
+    SX1278_sim_get_stats(receiver_radio, &rx_sim);
+    CHECK(tx_sim.hops - tx_hops > 10);
+    CHECK(rx_sim.hops - rx_hops > 10);
+    check_hops(sender_radio, table, 4);
+    check_hops(receiver_radio, table, 4);
+
+    CHECK(SX1278_set_hop_table(sender, NULL, 0, 0));
+    CHECK(SX1278_set_hop_table(receiver, NULL, 0, 0));
+    CHECK(sender->shadow[REG_FR_MID] == ((DEFAULT_SX1278_FREQUENCY >> 8) & 0xff));
+}
+
+typedef struct ScanRun_struct
+{
+    const SX1278ChannelPlan* plan;
+    int16_t rssi[4];
+    SX1278Task caller;
+} ScanRun;
+
+static void scan_task(void* p)
+{
+    ScanRun* run = p;
+    SX1278_scan_channels(receiver, run->plan, run->rssi, 400000);
+    SX1278_hal_task_notify(run->caller);
+    SX1278_hal_task_exit();
+}
+
+static void test_channel_scan()
+{
+    SX1278ChannelPlan plan;
+    int16_t rssi[4];
+    uint8_t payload[MAX_FIFO_BUFFER] = {0};
+    SX1278Stats before, after;
+    sender->tx_done_handle = SX1278_hal_task_self();
+
+    CHECK(SX1278_hz_to_frf(433000000) == 0x6c4000);
+    CHECK(SX1278_hz_to_frf(434000000) == DEFAULT_SX1278_FREQUENCY);
+    CHECK(SX1278_frf_to_hz(0x6c4000) == 433000000);
+    // One Frf step is about 61 Hz
+    int32_t error = (int32_t)(SX1278_frf_to_hz(SX1278_hz_to_frf(433175000)) - 433175000);
+    CHECK(error > -31 && error < 31);
+    CHECK(SX1278_channel_plan_init(&plan, 433000000, 500000, 4));
+    CHECK(plan.frf[2] == SX1278_hz_to_frf(434000000));
+    CHECK(!SX1278_channel_plan_init(&plan, 433000000, 500000, SX1278_MAX_PLAN_CHANNELS + 1));
+
+    // Occupy the third channel with a long frame, the scan must steer clear of it
+    CHECK(SX1278_channel_plan_init(&plan, 433000000, 500000, 4));
+    CHECK(SX1278_set_channel(sender, &plan, 2));
+    CHECK(!SX1278_set_channel(sender, &plan, 4));
+    CHECK(SX1278_transmit(sender, payload, sizeof(payload) - 1, SX1278_WAIT_FOREVER));
+    SX1278_hal_delay_ms(5);
+    SX1278_get_stats(receiver, &before);
+    uint8_t quietest = SX1278_scan_channels(receiver, &plan, rssi, 2000);
+    SX1278_get_stats(receiver, &after);
+    CHECK(quietest != 2);
+    CHECK(rssi[2] > rssi[quietest]);
+    CHECK(rssi[2] > rssi[0] && rssi[2] > rssi[1] && rssi[2] > rssi[3]);
+    CHECK(receiver->mode == Standby);
+    CHECK(receiver->shadow[REG_FR_MID] == ((DEFAULT_SX1278_FREQUENCY >> 8) & 0xff));
+    CHECK(after.mode_dwell_us[RxContinuous] - before.mode_dwell_us[RxContinuous] >= 4 * 2000);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+
+    // A mode command cuts a scan short, the channels it did not reach stay at INT16_MAX
+    ScanRun run = { .plan = &plan, .caller = SX1278_hal_task_self() };
+    SX1278_hal_task_create(scan_task, "scan", 0, &run, 0);
+    SX1278_hal_delay_ms(20);
+    SX1278_switch_mode(receiver, Standby);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(run.rssi[0] == INT16_MAX && run.rssi[3] == INT16_MAX);
+    CHECK(receiver->mode == Standby);
+
+    SX1278_set_frequency_hz(sender, 434000000);
+    CHECK(sender->settings.channel_freq == DEFAULT_SX1278_FREQUENCY);
+}
+
+static void on_op(SX1278Op* op, void* arg)
+{
+    uint32_t* calls = arg;
+    (*calls)++;
+    // The result is already in place when the callback runs
+    CHECK(op->status != OpPending);
+}
+
+static void test_async()
+{
+    uint8_t buffer[MAX_FIFO_BUFFER];
+    uint32_t calls = 0;
+    SX1278Op tx, rx;
+    // No helper tasks or notification handles, the operations carry their own completion
+    sender->tx_done_handle = NULL;
+    receiver->rx_done_handle = NULL;
+    SX1278_op_init(&tx, on_op, &calls);
+    SX1278_op_init(&rx, NULL, NULL);
+
+    // Nothing on air: a single receive runs into its symbol timeout
+    SX1278_receive_async(receiver, RxSingle, ExplicitHeaderMode, buffer, &rx);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpTimeout);
+
+    SX1278_receive_async(receiver, RxContinuous, ExplicitHeaderMode, buffer, &rx);
+    CHECK(SX1278_op_wait(&rx, 10) == OpPending);
+    CHECK(SX1278_transmit_async(sender, expected, sizeof(expected), &tx, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&tx, WAIT_MS) == OpDone);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    CHECK(calls == 1);
+    CHECK(rx.packet.size == sizeof(expected));
+    CHECK(memcmp(buffer, expected, sizeof(expected)) == 0);
+    // The frame went into the caller's buffer, the receiver is still listening
+    CHECK(SX1278_rx_available(receiver) == 0);
+    CHECK(receiver->mode == RxContinuous);
+
+    SX1278_receive_async(receiver, RxContinuous, ExplicitHeaderMode, NULL, &rx);
+    SX1278_switch_mode(receiver, Standby);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpAborted);
+    CHECK(SX1278_op_wait(&rx, 0) == OpAborted);
+}
+
+static void test_burst_fifo()
+{
+    uint8_t payload[MAX_FIFO_BUFFER - 1];
+    uint8_t buffer[MAX_FIFO_BUFFER];
+    SpiStats tx_spi, rx_spi;
+    SX1278Op tx, rx;
+    sender->tx_done_handle = NULL;
+    receiver->rx_done_handle = NULL;
+    for (uint8_t i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = i;
+    }
+    SX1278_op_init(&tx, NULL, NULL);
+    SX1278_op_init(&rx, NULL, NULL);
+
+    SX1278_receive_async(receiver, RxSingle, ExplicitHeaderMode, buffer, &rx);
+    wait_mode(receiver, RxSingle);
+    SX1278_reset_spi_stats(sender);
+    SX1278_reset_spi_stats(receiver);
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &tx, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&tx, WAIT_MS) == OpDone);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    wait_mode(receiver, Standby);
+    SX1278_get_spi_stats(sender, &tx_spi);
+    SX1278_get_spi_stats(receiver, &rx_spi);
+    CHECK(rx.packet.size == sizeof(payload));
+    CHECK(memcmp(buffer, payload, sizeof(payload)) == 0);
+    // The 255 bytes move in one 256 byte burst each way, the rest is mode, pointer, IRQ and status access
+    CHECK(tx_spi.transactions == 10 && tx_spi.bytes == 271);
+    CHECK(rx_spi.transactions == 12 && rx_spi.bytes == 275);
+}
+
+static void test_tx_abort()
+{
+    uint8_t payload[MAX_FIFO_BUFFER - 1] = {0};
+    uint8_t buffer[MAX_FIFO_BUFFER];
+    SX1278Op first, second, rx;
+    sender->tx_done_handle = NULL;
+    receiver->rx_done_handle = NULL;
+    SX1278_op_init(&first, NULL, NULL);
+    SX1278_op_init(&second, NULL, NULL);
+    SX1278_op_init(&rx, NULL, NULL);
+
+    SX1278_receive_async(receiver, RxContinuous, ExplicitHeaderMode, buffer, &rx);
+    wait_mode(receiver, RxContinuous);
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &first, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_transmit_async(sender, expected, sizeof(expected), &second, SX1278_WAIT_FOREVER));
+    wait_mode(sender, Tx);
+    // Leaving TX mid-frame ends that frame, the one queued behind it still goes
+    SX1278_switch_mode(sender, Standby);
+    CHECK(SX1278_op_wait(&first, WAIT_MS) == OpAborted);
+    CHECK(SX1278_op_wait(&second, WAIT_MS) == OpDone);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    CHECK(rx.packet.size == sizeof(expected));
+    CHECK(memcmp(buffer, expected, sizeof(expected)) == 0);
+    CHECK(SX1278_tx_pending(sender) == 0);
+    SX1278_switch_mode(receiver, Standby);
+
+    // Starting RX or CAD on air ends the frame the same way
+    SX1278_op_init(&first, NULL, NULL);
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &first, SX1278_WAIT_FOREVER));
+    wait_mode(sender, Tx);
+    SX1278_receive_async(sender, RxContinuous, ExplicitHeaderMode, NULL, &rx);
+    CHECK(SX1278_op_wait(&first, WAIT_MS) == OpAborted);
+    wait_mode(sender, RxContinuous);
+    SX1278_op_init(&first, NULL, NULL);
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &first, SX1278_WAIT_FOREVER));
+    wait_mode(sender, Tx);
+    SX1278_start_cad(sender);
+    CHECK(SX1278_op_wait(&first, WAIT_MS) == OpAborted);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpAborted);
+    wait_mode(sender, Standby);
+    CHECK(SX1278_tx_pending(sender) == 0);
+}
+
+static void test_turnaround()
+{
+    const uint8_t ack[] = {'a', 'c', 'k'};
+    const uint8_t polls[] = {1, MAX_FIFO_BUFFER - 1};
+    uint8_t long_poll[MAX_FIFO_BUFFER - 1];
+    uint8_t reply[MAX_FIFO_BUFFER];
+    SX1278Op poll, answer, rx;
+    SX1278Stats stats;
+    SX1278SimStats sim_stats[2];
+    sender->tx_done_handle = NULL;
+    receiver->rx_done_handle = NULL;
+    SX1278_reset_stats(receiver);
+    SX1278_op_init(&poll, NULL, NULL);
+    SX1278_op_init(&answer, NULL, NULL);
+    SX1278_op_init(&rx, NULL, NULL);
+    for (uint8_t i = 0; i < sizeof(long_poll); i++)
+    {
+        long_poll[i] = i;
+    }
+
+    // The reply sits in the upper FIFO half before the poll arrives
+    CHECK(SX1278_stage_reply(receiver, ack, sizeof(ack), &answer));
+    CHECK(receiver->shadow[REG_FIFO_TX_BASE_ADDR] == 0x80);
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+    wait_mode(receiver, RxContinuous);
+
+    // The poller keeps listening around its own TX and has to catch the reply's preamble
+    SX1278_receive_async(sender, RxContinuous, ExplicitHeaderMode, reply, &rx);
+    wait_mode(sender, RxContinuous);
+    CHECK(SX1278_transmit_async(sender, expected, sizeof(expected), &poll, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&poll, WAIT_MS) == OpDone);
+    CHECK(SX1278_op_wait(&answer, WAIT_MS) == OpDone);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    CHECK(rx.packet.size == sizeof(ack));
+    CHECK(memcmp(reply, ack, sizeof(ack)) == 0);
+
+    // The poll itself is intact in the lower half and the node is back in RX
+    CHECK(SX1278_get_fifo(receiver, reply) == sizeof(expected));
+    CHECK(memcmp(reply, expected, sizeof(expected)) == 0);
+    wait_mode(receiver, RxContinuous);
+    SX1278_get_stats(receiver, &stats);
+    CHECK(stats.replies == 1);
+    CHECK(stats.turnaround_us > 0 && stats.turnaround_us < SX1278_get_toa_us(receiver, sizeof(ack)));
+
+    // A staged reply is sent once
+    SX1278_op_init(&poll, NULL, NULL);
+    CHECK(SX1278_transmit_async(sender, expected, sizeof(expected), &poll, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&poll, WAIT_MS) == OpDone);
+    SX1278_hal_delay_ms(SX1278_get_toa_us(sender, sizeof(ack)) / 1000 + 10);
+    CHECK(SX1278_rx_available(sender) == 0);
+    CHECK(receiver->stats.replies == 1);
+    CHECK(SX1278_get_fifo(receiver, reply) == sizeof(expected));
+
+    // TX starts before the poll is read out, so a long poll costs only the bytes the reply is loaded over
+    for (uint8_t i = 0; i < sizeof(polls); i++)
+    {
+        SX1278_op_init(&poll, NULL, NULL);
+        SX1278_op_init(&answer, NULL, NULL);
+        CHECK(SX1278_stage_reply(receiver, ack, sizeof(ack), &answer));
+        CHECK(SX1278_transmit_async(sender, long_poll, polls[i], &poll, SX1278_WAIT_FOREVER));
+        CHECK(SX1278_op_wait(&answer, WAIT_MS) == OpDone);
+        SX1278_hal_delay_ms(SX1278_get_toa_us(sender, sizeof(ack)) / 1000 + 10);
+        CHECK(SX1278_get_fifo(receiver, reply) == polls[i]);
+        CHECK(memcmp(reply, long_poll, polls[i]) == 0);
+        CHECK(SX1278_get_fifo(sender, reply) == sizeof(ack));
+        SX1278_sim_get_stats(receiver_radio, &sim_stats[i]);
+    }
+    // The long poll ran over the reply: its 3 bytes there are read out and the reply loaded again
+    CHECK(sim_stats[1].reply_spi_bytes <= sim_stats[0].reply_spi_bytes + 2 * (sizeof(ack) + 3));
+
+    SX1278_switch_mode(sender, Standby);
+    SX1278_switch_mode(receiver, Standby);
+    wait_mode(sender, Standby);
+    wait_mode(receiver, Standby);
+}
+
+static void test_stream()
+{
+    uint8_t payload[200];
+    uint8_t received[MAX_FIFO_BUFFER];
+    SX1278Op tx, rx;
+    sender->tx_done_handle = NULL;
+    receiver->rx_done_handle = NULL;
+    for (uint8_t i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = i * 7;
+    }
+    SX1278_reset_stats(receiver);
+    // ValidHeader comes on DIO3, streaming cannot work without it
+    int dio3 = receiver->config.dio_pins[3];
+    receiver->config.dio_pins[3] = SX1278_PIN_UNUSED;
+    CHECK(!SX1278_set_rx_streaming(receiver, 1));
+    receiver->config.dio_pins[3] = dio3;
+    CHECK(SX1278_set_rx_streaming(receiver, 1));
+    SX1278_op_init(&tx, NULL, NULL);
+    SX1278_op_init(&rx, NULL, NULL);
+
+    // Most of the frame is already drained when RxDone fires
+    SX1278_receive_async(receiver, RxContinuous, ExplicitHeaderMode, received, &rx);
+    wait_mode(receiver, RxContinuous);
+    CHECK((receiver->shadow[REG_DIO_MAPPING_1] & 0b11) == 0b01);
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &tx, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    CHECK(rx.packet.size == sizeof(payload));
+    CHECK(memcmp(received, payload, sizeof(payload)) == 0);
+    CHECK(receiver->stats.rx_stream_bytes >= sizeof(payload) / 2);
+    CHECK(SX1278_op_wait(&tx, WAIT_MS) == OpDone);
+
+    // Frames for the ring stream into a pool block taken at the header
+    uint32_t streamed = receiver->stats.rx_stream_bytes;
+    SX1278_receive_async(receiver, RxContinuous, ExplicitHeaderMode, NULL, &rx);
+    wait_mode(receiver, RxContinuous);
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &tx, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    CHECK(receiver->stats.rx_stream_bytes - streamed >= sizeof(payload) / 2);
+    CHECK(SX1278_get_fifo(receiver, received) == sizeof(payload));
+    CHECK(memcmp(received, payload, sizeof(payload)) == 0);
+    CHECK(SX1278_op_wait(&tx, WAIT_MS) == OpDone);
+
+    // Still in RxContinuous, the next frame lands after this one and wraps around the FIFO
+    streamed = receiver->stats.rx_stream_bytes;
+    CHECK(SX1278_transmit_async(sender, payload, sizeof(payload), &tx, SX1278_WAIT_FOREVER));
+    // Op wake-ups from the frame before may still be in flight, so the ring is polled instead
+    for (uint32_t i = 0; i < WAIT_MS && SX1278_rx_available(receiver) == 0; i++)
+    {
+        SX1278_hal_delay_ms(1);
+    }
+    CHECK(receiver->stats.rx_stream_bytes - streamed >= sizeof(payload) / 2);
+    CHECK(receiver->rx_next == (uint8_t)(2 * sizeof(payload)));
+    PacketBuffer* packet = SX1278_rx_take(receiver);
+    CHECK(packet != NULL);
+    if (packet != NULL)
+    {
+        CHECK(packet->status.size == sizeof(payload));
+        CHECK(memcmp(packet->payload, payload, sizeof(payload)) == 0);
+        SX1278_pool_free(packet);
+    }
+    CHECK(SX1278_op_wait(&tx, WAIT_MS) == OpDone);
+
+    SX1278_set_rx_streaming(receiver, 0);
+    SX1278_switch_mode(receiver, Standby);
+    wait_mode(receiver, Standby);
+}
+
+static void test_implicit()
+{
+    const uint8_t telemetry[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    uint8_t received[MAX_FIFO_BUFFER];
+    SX1278Op tx, rx;
+    sender->tx_done_handle = NULL;
+    receiver->rx_done_handle = NULL;
+    SX1278_set_implicit_header(sender, 0, 1);
+    uint32_t explicit_toa = SX1278_get_toa_us(sender, sizeof(telemetry));
+    SX1278_reset_stats(receiver);
+
+    SX1278_set_implicit_header(sender, sizeof(telemetry), 1);
+    SX1278_set_implicit_header(receiver, sizeof(telemetry), 1);
+    CHECK(receiver->shadow[REG_PAYLOAD_LENGTH] == sizeof(telemetry));
+    CHECK(SX1278_get_toa_us(sender, sizeof(telemetry)) < explicit_toa);
+    // Another length cannot be told apart on air
+    CHECK(!SX1278_transmit(sender, telemetry, sizeof(telemetry) - 1, 0));
+
+    SX1278_op_init(&tx, NULL, NULL);
+    SX1278_op_init(&rx, NULL, NULL);
+    SX1278_receive_async(receiver, RxContinuous, ImplicitHeaderMode, received, &rx);
+    wait_mode(receiver, RxContinuous);
+    CHECK(SX1278_transmit_async(sender, telemetry, sizeof(telemetry), &tx, SX1278_WAIT_FOREVER));
+    CHECK(SX1278_op_wait(&tx, WAIT_MS) == OpDone);
+    CHECK(SX1278_op_wait(&rx, WAIT_MS) == OpDone);
+    CHECK(rx.packet.size == sizeof(telemetry));
+    CHECK(memcmp(received, telemetry, sizeof(telemetry)) == 0);
+    CHECK(receiver->stats.header_errors == 0 && receiver->stats.rx_packets == 1);
+    SX1278_switch_mode(receiver, Standby);
+    wait_mode(receiver, Standby);
+
+    SX1278_set_implicit_header(sender, 0, 1);
+    CHECK(SX1278_get_toa_us(sender, sizeof(telemetry)) == explicit_toa);
+    SX1278_set_implicit_header(sender, 0, 0);
+    SX1278_set_implicit_header(receiver, 0, 0);
+    CHECK(sender->settings.modem_config2.val == DEFAULT_MODEM_CONFIG2);
+}
+
+static uint8_t traced(SX1278* dev, TraceEvent event)
+{
+    TraceRecord records[CONFIG_SX1278_TRACE_LENGTH];
+    uint32_t count = SX1278_trace_read(dev, records, CONFIG_SX1278_TRACE_LENGTH);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (records[i].event == event)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void test_stats()
+{
+    SX1278Stats tx_stats, rx_stats;
+    SX1278Task self = SX1278_hal_task_self();
+    sender->tx_done_handle = self;
+    receiver->rx_done_handle = self;
+    SX1278_reset_stats(sender);
+    SX1278_reset_stats(receiver);
+
+    SX1278_start_rx(receiver, RxContinuous, ExplicitHeaderMode);
+    wait_mode(receiver, RxContinuous);
+    CHECK(SX1278_enqueue_tx(sender, expected, sizeof(expected), SX1278_WAIT_FOREVER));
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    CHECK(SX1278_hal_task_wait(0, WAIT_MS) > 0);
+    SX1278_switch_mode(receiver, Standby);
+    SX1278_hal_task_wait(1, WAIT_MS);
+    CHECK(SX1278_rx_available(receiver) == 1);
+    SX1278_rx_release(receiver);
+
+    SX1278_get_stats(sender, &tx_stats);
+    SX1278_get_stats(receiver, &rx_stats);
+    CHECK(tx_stats.tx_packets == 1);
+    CHECK(rx_stats.rx_packets == 1);
+    CHECK(rx_stats.crc_errors == 0 && rx_stats.header_errors == 0);
+    CHECK(tx_stats.spi.transactions > 0);
+
+    uint32_t irqs = 0;
+    for (uint8_t i = 0; i < SX1278_LATENCY_BUCKETS; i++)
+    {
+        irqs += tx_stats.irq_latency[i];
+    }
+    CHECK(irqs >= 1);
+    CHECK(tx_stats.mode_dwell_us[Tx] >= SX1278_get_toa_us(sender, sizeof(expected)));
+    CHECK(rx_stats.mode_dwell_us[RxContinuous] >= SX1278_get_toa_us(sender, sizeof(expected)));
+
+    CHECK(traced(sender, TraceTxStart));
+    CHECK(traced(sender, TraceTxDone));
+    CHECK(traced(receiver, TraceRxDone));
+}
+
+int main()
+{
+    sender = create_radio(&sender_radio, 10, 11, 12, 13, 14);
+    receiver = create_radio(&receiver_radio, 20, 21, 22, 23, 24);
+    CHECK(sender != NULL && receiver != NULL);
+
+    test_initialize();
+    test_ping();
+    test_tx_queue();
+    test_rx_timeout();
+    test_async();
+    test_burst_fifo();
+    test_tx_abort();
+    test_turnaround();
+    test_stream();
+    test_implicit();
+    test_cad();
+    test_stats();
+    test_lbt();
+    test_sniff();
+    test_fhss();
+    test_channel_scan();
+
+    SX1278_destroy(sender);
+    SX1278_destroy(receiver);
+    SX1278_sim_remove(sender_radio);
+    SX1278_sim_remove(receiver_radio);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,71 @@
+#include "SX1278Toa.h"
+#include "stdio.h"
+#include "math.h"
+
+static const double bandwidth_khz[] = {
+    7.8125, 125.0 / 12, 15.625, 125.0 / 6, 31.25, 125.0 / 3, 62.5, 125, 250, 500
+};
+
+static int failures = 0;
+
+// Semtech AN1200.13 time-on-air formula in floating point, result in ms
+static double reference_toa(int sf, int bw, int cr, int preamble_len, int ih, int crc, int de, int pl)
+{
+    double t_sym = pow(2, sf) / bandwidth_khz[bw];
+    double t_preamble = (preamble_len + 4.25) * t_sym;
+    double n = ceil((8.0 * pl - 4 * sf + 28 + 16 * crc - 20 * ih) / (4 * (sf - 2 * de))) * (cr + 4);
+    double payload = 8 + (n > 0 ? n : 0);
+    return t_preamble + payload * t_sym;
+}
+
+static void check(int sf, int bw, int cr, int preamble_len, int ih, int crc, int de)
+{
+    ToaParams params;
+    SX1278_toa_prepare(&params, sf, bw, cr, preamble_len, ih, crc, de);
+    for (int pl = 0; pl < MAX_FIFO_BUFFER; pl++)
+    {
+        double expected = reference_toa(sf, bw, cr, preamble_len, ih, crc, de, pl) * 1000;
+        double actual = SX1278_toa_us(&params, pl);
+        // 1 us rounding, or 1 ppm for multi-second frames at the narrow bandwidths
+        if (fabs(actual - expected) > fmax(1.0, expected * 1e-6))
+        {
+            if (failures++ < 10)
+            {
+                printf("SF%d bw=%d CR4/%d pre=%d ih=%d crc=%d de=%d pl=%d: %.0f us, expected %.1f us\n",
+                    sf, bw, cr + 4, preamble_len, ih, crc, de, pl, actual, expected);
+            }
+        }
+    }
+}
+
+int main()
+{
+    int combinations = 0;
+    for (int sf = SF7; sf <= SF12; sf++)
+    {
+        for (int bw = Bw7_8kHz; bw <= Bw500kHz; bw++)
+        {
+            for (int cr = CR5; cr <= CR8; cr++)
+            {
+                for (int flags = 0; flags < 8; flags++)
+                {
+                    check(sf, bw, cr, 8, flags & 1, (flags >> 1) & 1, (flags >> 2) & 1);
+                    combinations++;
+                }
+            }
+        }
+    }
+    check(SF7, Bw500kHz, CR8, 65535, 0, 1, 0);
+    check(SF7, Bw500kHz, CR5, 6, 1, 0, 0);
+
+    ToaParams params;
+    SX1278_toa_prepare(&params, SF12, Bw7_8kHz, CR8, 65535, 0, 1, 1);
+    if (SX1278_toa_us(&params, 255) != UINT32_MAX)
+    {
+        printf("Time on air above 2^32 us does not saturate\n");
+        failures++;
+    }
+
+    printf("%d configurations, %d mismatches\n", combinations, failures);
+    return failures == 0 ? 0 : 1;
+}
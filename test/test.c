@@ -17,83 +17,124 @@ static SX1278Settings settings = {
 // static uint8_t expected[] = {'s', 'x', '1', '2', '7', '8'};
 static uint8_t expected[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 254, 255, 255, 0, 0, 10, 170, 170, 0, 0, 180, 62, 5, 247};
 SX1278* dev;
-static uint8_t task_done = 1;
 
 void app_main(void)
 {
-    dev = SX1278_create();
+    SX1278Config config = SX1278_DEFAULT_CONFIG();
+    dev = SX1278_create(&config);
+    ESP_LOGI("SX1278", "Ready after %u us", SX1278_get_ready_us(dev));
     unity_run_menu();
 }
 
-void on_tx_done(void* p)
+static void sender()
 {
-    SX1278* dev = p;
-    while (1)
-    {
-        if (ulTaskNotifyTake(pdTRUE, (TickType_t) portMAX_DELAY) > 0)
-        {
-            task_done = 0;
-            vTaskDelete(dev->tx_done_handle);
-        }
-    }
+    SX1278Op op;
+    SX1278_op_init(&op, NULL, NULL);
+    SX1278_transmit_async(dev, expected, sizeof(expected), &op, SX1278_WAIT_FOREVER);
+
+    TEST_ASSERT_EQUAL(OpDone, SX1278_op_wait(&op, 5000));
+    unity_send_signal("Sender sent");
+    ESP_LOGI("SX1278", "Time on air: %u us", SX1278_get_toa_us(dev, sizeof(expected)));
 }
 
-void on_rx_done(void* p)
+static void receiver()
 {
-    SX1278* dev = p;
-    while (1)
+    SX1278Op op;
+    uint8_t received[MAX_FIFO_BUFFER];
+    while (SX1278_rx_peek(dev) != NULL) { SX1278_rx_release(dev); };
+    SX1278_op_init(&op, NULL, NULL);
+    SX1278_receive_async(dev, RxContinuous, ExplicitHeaderMode, received, &op);
+
+    unity_send_signal("Receiver ready");
+    OpStatus status = SX1278_op_wait(&op, 5000);
+    SX1278_switch_mode(dev, Sleep);
+    if (status == OpPending)
     {
-        if (ulTaskNotifyTake(pdTRUE, (TickType_t) portMAX_DELAY) > 0)
-        {
-            task_done = 0;
-            vTaskDelete(dev->rx_done_handle);
-        }
+        // The switch aborts the receive, it has to finish before op leaves the stack
+        SX1278_op_wait(&op, SX1278_WAIT_FOREVER);
+        TEST_FAIL_MESSAGE("Time out for 5 secs");
     }
+    TEST_ASSERT_EQUAL(OpDone, status);
+    TEST_ASSERT_EQUAL_UINT8(sizeof(expected), op.packet.size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, received, sizeof(expected));
 }
 
-static void sender()
+/////////////////////////////   SPI    /////////////////////////////////////////
+
+TEST_CASE("Test burst FIFO load", "[sx1278][SPI]")
+{
+    uint8_t payload[255] = {0};
+    SpiStats stats;
+    SX1278Op op;
+
+    SX1278_initialize(dev, &settings);
+    SX1278_op_init(&op, NULL, NULL);
+
+    SX1278_reset_spi_stats(dev);
+    SX1278_transmit_async(dev, payload, sizeof(payload), &op, SX1278_WAIT_FOREVER);
+    TEST_ASSERT_EQUAL(OpDone, SX1278_op_wait(&op, SX1278_WAIT_FOREVER));
+    SX1278_get_spi_stats(dev, &stats);
+
+    TEST_ASSERT_TRUE(stats.transactions < 16);
+}
+
+TEST_CASE("Test diff-only reconfigure", "[sx1278][SPI]")
+{
+    SX1278Settings profile = settings;
+
+    SX1278_initialize(dev, &settings);
+    TEST_ASSERT_EQUAL_UINT32(0, SX1278_reconfigure(dev, &settings));
+
+    profile.modem_config2.bits.spreading_factor = SF12;
+    profile.modem_config1.bits.bandwidth = Bw250kHz;
+    // One burst over MODEM_CONFIG1..2
+    TEST_ASSERT_EQUAL_UINT32(3, SX1278_reconfigure(dev, &profile));
+    TEST_ASSERT_EQUAL_UINT32(0, SX1278_verify_shadow(dev));
+
+    SX1278_reconfigure(dev, &settings);
+}
+
+static void tx_queue_sender()
 {
-    task_done = 1;
-    xTaskCreate(on_tx_done, "tx_done", 1024, (void*)dev, tskIDLE_PRIORITY, &dev->tx_done_handle);
-    dev->fifo.size = 0;
-    SX1278_fill_fifo(dev, expected, sizeof(expected));
-    SX1278_start_tx(dev);
-    
-    while (task_done) { vTaskDelay(100 / portTICK_PERIOD_MS); };
+    SX1278_initialize(dev, &settings);
+    dev->tx_done_handle = xTaskGetCurrentTaskHandle();
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_TRUE(SX1278_enqueue_tx(dev, expected, sizeof(expected), SX1278_WAIT_FOREVER));
+    }
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        ulTaskNotifyTake(pdFALSE, (TickType_t) portMAX_DELAY);
+    }
+    dev->tx_done_handle = NULL;
     unity_send_signal("Sender sent");
-    ESP_LOGI("SX1278", "Time on air: %f", SX1278_get_toa(dev));
 }
 
-static void receiver()
+static void tx_queue_receiver()
 {
-    task_done = 1;
-    xTaskCreate(on_rx_done, "rx_done", 1024, (void*)dev, tskIDLE_PRIORITY, &dev->rx_done_handle);
+    SX1278_initialize(dev, &settings);
+    while (SX1278_rx_peek(dev) != NULL) { SX1278_rx_release(dev); };
     SX1278_start_rx(dev, RxContinuous, ExplicitHeaderMode);
-
     unity_send_signal("Receiver ready");
+
     long start = xTaskGetTickCount();
-    uint8_t isTimeOut = 0;
-    while (task_done) 
-    { 
-        long time = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
-        if (time > 5000) 
-        { 
-            isTimeOut = 1;
-            break;
-        }
-        vTaskDelay(100 / portTICK_PERIOD_MS); 
-    };
-    SX1278_switch_mode(dev, Sleep);
-    if (!isTimeOut)
+    while (SX1278_rx_available(dev) < 3 && (xTaskGetTickCount() - start) * portTICK_PERIOD_MS < 5000)
     {
-        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, dev->fifo.buffer, sizeof(expected));
+        vTaskDelay(100 / portTICK_PERIOD_MS);
     }
-    else 
+    SX1278_switch_mode(dev, Sleep);
+
+    TEST_ASSERT_EQUAL(3, SX1278_rx_available(dev));
+    for (PacketBuffer* packet = SX1278_rx_peek(dev); packet != NULL; packet = SX1278_rx_peek(dev))
     {
-        TEST_FAIL_MESSAGE("Time out for 5 secs");
+        TEST_ASSERT_EQUAL_UINT8(sizeof(expected), packet->status.size);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, packet->payload, sizeof(expected));
+        SX1278_rx_release(dev);
     }
 }
 
+TEST_CASE_MULTIPLE_DEVICES("Test TX queue", "[sx1278][TX]", tx_queue_sender, tx_queue_receiver);
+
 ///////////////////////////   Custome    ///////////////////////////////////////
 
 static void custome_sender()